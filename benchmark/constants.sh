@@ -0,0 +1,26 @@
+#!/bin/bash
+# Constant pool benchmark: compiles and runs a script with about 50k distinct number literals and as
+# many repeated string literals, all in the constant pool of the top level script. Running it is
+# cheap, so the time is mostly compilation.
+#
+# usage: benchmark/constants.sh path/to/main [number of literals]
+set -e
+
+MAIN=${1:?usage: $0 path/to/main [number of literals]}
+COUNT=${2:-50000}
+SCRIPT=${TMPDIR:-/tmp}/constants_${COUNT}.lox
+
+if [ ! -f "$SCRIPT" ]; then
+		{
+				echo "var x = 0;"
+				echo "var s = \"\";"
+				for ((i = 0; i < COUNT; ++i)); do
+						echo "x = x + $i.5; s = \"label$((i % 100))\";"
+				done
+				echo "print x;"
+		} > "$SCRIPT"
+fi
+
+echo "file: $(wc -c < "$SCRIPT") bytes, $((2 * COUNT)) literals"
+TIMEFORMAT="  %R s"
+time "$MAIN" "$SCRIPT" > /dev/null
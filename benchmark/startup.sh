@@ -0,0 +1,27 @@
+#!/bin/bash
+# Startup benchmark: compiles and runs a synthetic script of about 100 MB, loaded from
+# the file (mapped in memory) and from a pipe (read into a buffer).
+#
+# usage: benchmark/startup.sh path/to/main [size in MB]
+set -e
+
+MAIN=${1:?usage: $0 path/to/main [size in MB]}
+SIZE_MB=${2:-100}
+SCRIPT=${TMPDIR:-/tmp}/startup_${SIZE_MB}mb.lox
+
+# Each line is 29 bytes.
+if [ ! -f "$SCRIPT" ]; then
+		LINES=$((SIZE_MB * 1024 * 1024 / 29))
+		{
+				echo "var x = 0;"
+				yes "x = x + 1 * 2 - (3 + x) / 4;" | head -n "$LINES"
+				echo "print x;"
+		} > "$SCRIPT"
+fi
+
+echo "file: $(wc -c < "$SCRIPT") bytes"
+TIMEFORMAT="  %R s"
+echo "mmap:"
+time "$MAIN" "$SCRIPT" > /dev/null
+echo "pipe:"
+time (cat "$SCRIPT" | "$MAIN" - > /dev/null)
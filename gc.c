@@ -0,0 +1,302 @@
+#include "gc.h"
+#include "vm.h"
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+GC gc = { .next_major = GC_INITIAL_THRESHOLD };
+
+void *allocateObject(size_t size, ObjectType type) {
+		Object *object = malloc(size);
+		CHECK(object != NULL, "Failed to allocate memory");
+
+		object->type = type;
+		object->is_old = false;
+		object->mark = 0;
+		object->next = gc.young_objects;
+		gc.young_objects = object;
+
+		gc.young_bytes += size;
+		gc.total_bytes_allocated += size;
+		return object;
+}
+
+static size_t objectSize(Object *object) {
+		switch(object->type) {
+				case OBJECT_STRING:
+						return sizeof(String) + ((String *) object)->length + 1;
+				case OBJECT_FUNCTION:
+						return sizeof(Function);
+		}
+		CHECK(false, "Unreachable state");
+		return 0;
+}
+
+// Frees an object that is not linked in the lists of objects (or that was just unlinked).
+void freeObject(Object *object) {
+		size_t size = objectSize(object);
+		if(object->is_old) gc.old_bytes -= size;
+		else gc.young_bytes -= size;
+		gc.total_bytes_freed += size;
+
+		switch(object->type) {
+				case OBJECT_STRING:
+						free(object);
+						break;
+				case OBJECT_FUNCTION:
+						freeFunction((Function *) object);
+						break;
+		}
+}
+
+void discardObject(Object *object) {
+		CHECK(gc.young_objects == object, "Only the most recent object can be discarded");
+		gc.young_objects = object->next;
+		freeObject(object);
+}
+
+static void freeObjectList(Object *object) {
+		while(object != NULL) {
+				Object *next = object->next;
+				freeObject(object);
+				object = next;
+		}
+}
+
+void freeObjects() {
+		freeObjectList(gc.young_objects);
+		freeObjectList(gc.old_objects);
+		gc.young_objects = gc.old_objects = NULL;
+		gc.phase = GC_IDLE;
+		gc.sweep_link = NULL;
+
+		free(gc.gray_stack);
+		gc.gray_stack = NULL;
+		gc.gray_count = gc.gray_capacity = 0;
+}
+
+static void pushGray(Object *object) {
+		if(gc.gray_count + 1 > gc.gray_capacity) {
+				gc.gray_capacity = gc.gray_capacity > 0 ? 2 * gc.gray_capacity : 8;
+				gc.gray_stack = realloc(gc.gray_stack, sizeof(Object *) * gc.gray_capacity);
+				CHECK(gc.gray_stack != NULL, "Failed to allocate memory");
+		}
+		gc.gray_stack[gc.gray_count++] = object;
+}
+
+// Moves a reachable young object to the old generation. The object is linked in the old list
+// by the minor collection, once all the young objects have been visited.
+static void promoteObject(Object *object) {
+		if(object->is_old) return;
+		size_t size = objectSize(object);
+		gc.young_bytes -= size;
+		gc.old_bytes += size;
+		object->is_old = true;
+
+		// Objects promoted during a major collection survive it.
+		object->mark = gc.phase != GC_IDLE ? gc.epoch : 0;
+
+		// Strings have no references, there is no need to visit them again.
+		if(object->type != OBJECT_STRING) pushGray(object);
+}
+
+// Marks an old object for the current major collection.
+static void markObject(Object *object) {
+		if(object->mark == gc.epoch) return;
+		object->mark = gc.epoch;
+		if(object->type != OBJECT_STRING) pushGray(object);
+}
+
+// Visits a reference found in a root or in a gray object: young objects are promoted, old ones
+// are marked if the major collection is marking.
+static void visitObject(Object *object) {
+		if(object == NULL) return;
+		if(!object->is_old) promoteObject(object);
+		else if(gc.phase == GC_MARKING) markObject(object);
+}
+
+static void visitValue(Value value) {
+		if(IS_STRING(value)) visitObject((Object *) AS_STRING(value));
+		else if(IS_FUNCTION(value)) visitObject((Object *) AS_FUNCTION(value));
+}
+
+static void visitRoots() {
+		for(int i = 0; i < vm.stack_top; ++i) {
+				visitValue(vm.stack[i]);
+		}
+		for(int i = 0; i < vm.global_count; ++i) {
+				visitValue(vm.globals[i]);
+		}
+		for(int i = 0; i < vm.frame_top; ++i) {
+				visitObject((Object *) vm.frames[i].function);
+		}
+		visitObject((Object *) global_function);
+}
+
+// Visits the references of a gray object (a function, whose constant pool is its only reference).
+static void blackenObject(Object *object) {
+		Function *function = (Function *) object;
+		for(int i = 0; i < function->constants.count; ++i) {
+				visitValue(function->constants.array[i]);
+		}
+}
+
+static void releaseObject(Object *object) {
+		if(object->type == OBJECT_STRING) removeString((String *) object);
+		freeObject(object);
+}
+
+static void minorCollection() {
+		int gray_base = gc.gray_count;
+		visitRoots();
+		while(gc.gray_count > gray_base) {
+				blackenObject(gc.gray_stack[--gc.gray_count]);
+		}
+
+		Object *object = gc.young_objects;
+		gc.young_objects = NULL;
+		while(object != NULL) {
+				Object *next = object->next;
+				if(object->is_old) {
+						object->next = gc.old_objects;
+						gc.old_objects = object;
+				}
+				else {
+						releaseObject(object);
+				}
+				object = next;
+		}
+		gc.minor_collections++;
+}
+
+// Starts a major collection by marking the roots. Must follow a minor collection, so that
+// every root is old.
+static void startMajorCollection() {
+		gc.epoch++;
+		if(gc.epoch == 0) gc.epoch = 1;
+		gc.phase = GC_MARKING;
+		visitRoots();
+}
+
+static void finishMajorCollection() {
+		gc.phase = GC_IDLE;
+		gc.sweep_link = NULL;
+		gc.next_major = gc.old_bytes * GC_HEAP_GROW_FACTOR;
+		if(gc.next_major < GC_INITIAL_THRESHOLD) gc.next_major = GC_INITIAL_THRESHOLD;
+		gc.major_collections++;
+}
+
+// Traces or sweeps at most `work` old objects.
+static void majorCollectionStep(int work) {
+		while(gc.phase == GC_MARKING && work > 0) {
+				if(gc.gray_count == 0) {
+						gc.phase = GC_SWEEPING;
+						gc.sweep_link = &gc.old_objects;
+						break;
+				}
+				blackenObject(gc.gray_stack[--gc.gray_count]);
+				work--;
+		}
+
+		while(gc.phase == GC_SWEEPING && work > 0) {
+				Object *object = *gc.sweep_link;
+				if(object == NULL) {
+						finishMajorCollection();
+						break;
+				}
+				if(object->mark == gc.epoch) {
+						gc.sweep_link = &object->next;
+				}
+				else {
+						*gc.sweep_link = object->next;
+						releaseObject(object);
+				}
+				work--;
+		}
+}
+
+void shadeObject(Object *object) {
+		if(!object->is_old || gc.phase == GC_IDLE) return;
+		if(gc.phase == GC_MARKING) markObject(object);
+		// While sweeping, an object that was not swept yet is kept by giving it the current mark.
+		// Only strings are ever shaded, so no reference of the object has been swept before it.
+		else object->mark = gc.epoch;
+}
+
+bool shouldCollectGarbage() {
+#ifdef GC_STRESS
+		return true;
+#else
+		return gc.young_bytes > GC_NURSERY_SIZE;
+#endif
+}
+
+static uint64_t nanoseconds() {
+		struct timespec time;
+		clock_gettime(CLOCK_MONOTONIC, &time);
+		return (uint64_t) time.tv_sec * 1000000000u + time.tv_nsec;
+}
+
+static void recordPause(uint64_t pause_ns) {
+		uint64_t microseconds = pause_ns / 1000;
+		int bucket = 0;
+		while(microseconds > 0 && bucket < GC_PAUSE_BUCKETS - 1) {
+				microseconds >>= 1;
+				bucket++;
+		}
+		gc.pause_histogram[bucket]++;
+		gc.total_pause_ns += pause_ns;
+		if(pause_ns > gc.max_pause_ns) gc.max_pause_ns = pause_ns;
+}
+
+// Expects `vm.stack_top` and `vm.frame_top` to be up to date.
+void collectGarbage() {
+		uint64_t start = nanoseconds();
+		size_t promoted_bytes = gc.old_bytes;
+		if(gc.young_bytes + gc.old_bytes > gc.max_heap_bytes) gc.max_heap_bytes = gc.young_bytes + gc.old_bytes;
+
+		minorCollection();
+
+		promoted_bytes = gc.old_bytes - promoted_bytes;
+		if(gc.phase == GC_IDLE && gc.old_bytes > gc.next_major) {
+				startMajorCollection();
+		}
+		else if(gc.phase != GC_IDLE) {
+				// Steps must keep up with the promotions, or the major collection would never end.
+				int work = GC_STEP_WORK;
+				if(promoted_bytes / sizeof(String) > (size_t) work) work = 2 * (promoted_bytes / sizeof(String));
+				majorCollectionStep(work);
+		}
+
+		recordPause(nanoseconds() - start);
+}
+
+GCPauseStats getGCPauseStats() {
+		GCPauseStats stats = { .max_pause_ns = gc.max_pause_ns, .total_pause_ns = gc.total_pause_ns };
+		for(int i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+				stats.histogram[i] = gc.pause_histogram[i];
+				stats.pause_count += gc.pause_histogram[i];
+		}
+		return stats;
+}
+
+void printGCStats() {
+		fprintf(stderr, "[GC] minor collections: %d, major collections: %d, allocated: %zu bytes, freed: %zu bytes, live: %zu bytes, peak: %zu bytes\n",
+						gc.minor_collections, gc.major_collections, gc.total_bytes_allocated, gc.total_bytes_freed,
+						gc.young_bytes + gc.old_bytes, gc.max_heap_bytes);
+
+		GCPauseStats stats = getGCPauseStats();
+		if(stats.pause_count == 0) return;
+
+		fprintf(stderr, "[GC] pauses: %llu, total: %.3f ms, max: %.3f ms\n", (unsigned long long) stats.pause_count,
+						stats.total_pause_ns / 1e6, stats.max_pause_ns / 1e6);
+		for(int i = 0; i < GC_PAUSE_BUCKETS; ++i) {
+				if(stats.histogram[i] == 0) continue;
+				if(i == 0) fprintf(stderr, "[GC]   < 1 us: %llu\n", (unsigned long long) stats.histogram[i]);
+				else if(i == GC_PAUSE_BUCKETS - 1) fprintf(stderr, "[GC]   >= %llu us: %llu\n",
+								1ull << (i - 1), (unsigned long long) stats.histogram[i]);
+				else fprintf(stderr, "[GC]   [%llu, %llu) us: %llu\n", 1ull << (i - 1), 1ull << i,
+								(unsigned long long) stats.histogram[i]);
+		}
+}
@@ -0,0 +1,125 @@
+#ifndef COMPILER_GC_H
+#define COMPILER_GC_H
+
+#include "value.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// Size of the young generation: a minor collection happens every time this many bytes
+// have been allocated.
+#ifndef GC_NURSERY_SIZE
+#define GC_NURSERY_SIZE (256 * 1024)
+#endif
+
+// Size of the old generation that starts the first major collection.
+#ifndef GC_INITIAL_THRESHOLD
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#endif
+
+// After a major collection, the next one starts once the old generation has grown to
+// GC_HEAP_GROW_FACTOR times the size of what survived.
+#define GC_HEAP_GROW_FACTOR 2
+
+// Minimum number of objects traced or swept by one step of a major collection.
+#ifndef GC_STEP_WORK
+#define GC_STEP_WORK 1024
+#endif
+
+// Pauses are counted in buckets of powers of two microseconds: bucket 0 counts the pauses
+// shorter than 1us, bucket i the ones in [2^(i-1), 2^i) us, and the last bucket all the longer ones.
+#define GC_PAUSE_BUCKETS 24
+
+/*
+ * Generational and incremental garbage collector for the objects of the language (strings and functions).
+ *
+ * New objects are linked in the list `young_objects`. Once GC_NURSERY_SIZE bytes have been allocated,
+ * a minor collection moves the young objects reachable from the roots (the value stack, the global
+ * variables, the functions of the call frames and the script function) to the list `old_objects` and frees the others.
+ * No remembered set is needed: objects are never modified once the program runs (strings are immutable
+ * and constant pools are filled by the compiler), so an old object can not refer to a young one.
+ * Short lived strings, like the temporaries of a loop, die young and cost nothing but their free.
+ *
+ * The old generation is collected by a major collection, which is spread over many small steps to keep
+ * the pauses short. It starts by marking the roots (tagging them with the current `epoch`), then every
+ * minor collection is followed by a step that traces or sweeps a bounded number of old objects.
+ * Marking works on a snapshot of the roots: a value can only reach the stack from the snapshot, from a
+ * constant pool, or from a new allocation, and objects promoted during a major collection are considered
+ * marked. The only other way to get back an unreachable object is the string intern table, which shades
+ * the strings it returns (see shadeObject).
+ *
+ * Collections are triggered by the VM between instructions. Every pause (a minor collection and the
+ * major step that follows it) is timed and counted in `pause_histogram`, which getGCPauseStats() exposes.
+ *
+ * Defining GC_STRESS collects at every opportunity, which is useful to catch missing roots.
+ * */
+typedef struct GC GC;
+
+typedef enum { GC_IDLE, GC_MARKING, GC_SWEEPING } GCPhase;
+
+struct GC {
+		Object *young_objects;
+		Object *old_objects;
+		size_t young_bytes;
+		size_t old_bytes;
+
+		// State of the major collection.
+		GCPhase phase;
+		uint32_t epoch;
+		Object **sweep_link;
+		size_t next_major;
+
+		// Gray objects: marked, but their references are not marked yet.
+		Object **gray_stack;
+		int gray_count;
+		int gray_capacity;
+
+		// Statistics since the start of the program.
+		size_t total_bytes_allocated;
+		size_t total_bytes_freed;
+		// Largest young_bytes + old_bytes, sampled when collections start (the heap only grows between them).
+		size_t max_heap_bytes;
+		int minor_collections;
+		int major_collections;
+		uint64_t pause_histogram[GC_PAUSE_BUCKETS];
+		uint64_t max_pause_ns;
+		uint64_t total_pause_ns;
+};
+
+// Allocates an object of `size` bytes of the given type and links it in the young generation.
+void *allocateObject(size_t size, ObjectType type);
+void freeObject(Object *object);
+
+// Unlinks and frees `object`, which must be the most recently allocated object.
+void discardObject(Object *object);
+
+// Keeps `object` alive until the end of the current major collection. Must be called when an object
+// that may be unreachable is handed back to the program.
+void shadeObject(Object *object);
+
+// Frees all the objects, reachable or not. Used when the program is done.
+void freeObjects();
+
+// Returns true when the young generation is full.
+bool shouldCollectGarbage();
+
+// Runs a minor collection, followed by a step of the major collection if one is in progress or due.
+void collectGarbage();
+
+// Pauses of the collector since the start of the program, as returned by getGCPauseStats().
+// `histogram` is bucketed like GC_PAUSE_BUCKETS describes, and its buckets add up to `pause_count`.
+typedef struct {
+		uint64_t histogram[GC_PAUSE_BUCKETS];
+		uint64_t pause_count;
+		uint64_t max_pause_ns;
+		uint64_t total_pause_ns;
+} GCPauseStats;
+
+// Returns a copy of the pause statistics, for embedders that want them without reading `gc`.
+GCPauseStats getGCPauseStats();
+
+// Prints the allocation statistics and the histogram of the pauses of the collector to stderr.
+void printGCStats();
+
+extern GC gc;
+
+#endif
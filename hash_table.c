@@ -4,125 +4,137 @@
 #include <stddef.h>
 #include <stdlib.h>
 
+char hash_table_tombstone;
+
 static char *dynamicStrCpy(char *s) {
 		char *ret = malloc(strlen(s) + 1);
 		strcpy(ret, s);
 		return ret;
 }
 
-void initEntryArray(EntryArray *entry_array) {
-		entry_array->count = 0;
-		entry_array->capacity = 0;
-		entry_array->array = NULL;
-}
-
-void freeEntryArray(EntryArray *entry_array) {
-		for(int r = 0; r < entry_array->count; ++r) {
-				free(entry_array->array[r].key);
-		}
-		free(entry_array->array);
-		initEntryArray(entry_array);
-}
-
-// Grow the array when the number of elements reaches the max capacity of the array.
-void writeEntryArray(EntryArray *entry_array, Entry entry) {
-		if(entry_array->count + 1 > entry_array->capacity) {
-				entry_array->capacity = entry_array->capacity > 0 ? 2 * entry_array->capacity : 8;
-				entry_array->array = realloc(entry_array->array, sizeof(Entry) * entry_array->capacity);
-		}
-		entry_array->array[entry_array->count] = entry;
-		entry_array->count++;
-}
-
 void initHashTable(HashTable *hash_table) {
 		hash_table->count = 0;
 		hash_table->capacity = 0;
-		hash_table->table = NULL;
+		hash_table->entries = NULL;
 }
 
 void freeHashTable(HashTable *hash_table) {
 		for(int c = 0; c < hash_table->capacity; ++c) {
-				freeEntryArray(&hash_table->table[c]);
+				if(isLiveEntry(&hash_table->entries[c])) free(hash_table->entries[c].key);
 		}
-		free(hash_table->table);
+		free(hash_table->entries);
 		initHashTable(hash_table);
 }
 
-void resize(HashTable *hash_table, int new_capacity) {
-		EntryArray *new_table = malloc(new_capacity * sizeof(EntryArray));
-		for(int c = 0; c < new_capacity; ++c) {
-				initEntryArray(&new_table[c]);
+// Returns the entry holding `key`, or the entry where it should be inserted
+// (the first tombstone met, if any). The table must not be full.
+static Entry *findEntry(Entry *entries, int capacity, char *key, uint32_t key_hash) {
+		uint32_t mask = capacity - 1;
+		uint32_t index = key_hash & mask;
+		Entry *first_tombstone = NULL;
+
+		for(;;) {
+				Entry *entry = &entries[index];
+				if(entry->key == NULL) {
+						return first_tombstone != NULL ? first_tombstone : entry;
+				}
+				if(entry->key == HASH_TABLE_TOMBSTONE) {
+						if(first_tombstone == NULL) first_tombstone = entry;
+				}
+				else if(entry->hash == key_hash && strcmp(entry->key, key) == 0) {
+						return entry;
+				}
+				index = (index + 1) & mask;
 		}
+}
 
+void resize(HashTable *hash_table, int new_capacity) {
+		CHECK((new_capacity & (new_capacity - 1)) == 0, "Capacity of a hash table must be a power of two");
+		Entry *new_entries = calloc(new_capacity, sizeof(Entry));
+		CHECK(new_entries != NULL, "Failed to allocate memory");
+
+		int count = 0;
 		for(int c = 0; c < hash_table->capacity; ++c) {
-				EntryArray *row = &hash_table->table[c];
-				for(int r = 0; r < row->count; ++r) {
-						int index = hash(row->array[r].key) % new_capacity;
-						writeEntryArray(&new_table[index], row->array[r]);
-				}
+				Entry *entry = &hash_table->entries[c];
+				if(!isLiveEntry(entry)) continue;
+
+				*findEntry(new_entries, new_capacity, entry->key, entry->hash) = *entry;
+				count++;
 		}
-		
+
+		free(hash_table->entries);
+		hash_table->count = count;
+		hash_table->capacity = new_capacity;
+		hash_table->entries = new_entries;
+}
+
+// Rebuilds the table without its tombstones when it is full. The capacity doubles only if the live
+// entries would fill the rebuilt table more than halfway to its maximum load, so that a table whose
+// used entries are mostly tombstones (insertions and deletions of different keys) is rebuilt in place
+// instead of growing without bound.
+static void growHashTable(HashTable *hash_table) {
+		int live_count = 0;
 		for(int c = 0; c < hash_table->capacity; ++c) {
-				freeEntryArray(&hash_table->table[c]);
+				live_count += isLiveEntry(&hash_table->entries[c]);
 		}
 
-		free(hash_table->table);
-		hash_table->capacity = new_capacity;
-		hash_table->table = new_table;
+		int capacity = hash_table->capacity;
+		while(2 * live_count > capacity * MAX_LOAD_FACTOR) capacity *= 2;
+		resize(hash_table, capacity);
 }
 
 Entry *keyExists(HashTable *hash_table, char *key) {
-		int index = hash(key) % hash_table->capacity;
-		EntryArray *entry_array = &hash_table->table[index];
+		if(hash_table->count == 0) return NULL;
 
-		for(int r = 0; r < entry_array->count; ++r) {
-				if(strcmp(entry_array->array[r].key, key) == 0) return &entry_array->array[r];
-		}
-		return NULL;
+		Entry *entry = findEntry(hash_table->entries, hash_table->capacity, key, hash(key));
+		return isLiveEntry(entry) ? entry : NULL;
 }
 
 void insertHashTable(HashTable *hash_table, Entry entry) {
-		if(hash_table->count + 1 > hash_table->capacity * MAX_LOAD_FACTOR) {
-				int new_capacity = hash_table->capacity > 0 ? 2 * hash_table->capacity :
-						INITIAL_TABLE_CAPACITY;
-
-				resize(hash_table, new_capacity);
-		}
+		if(hash_table->capacity == 0) resize(hash_table, INITIAL_TABLE_CAPACITY);
 
-		Entry *entry_found = keyExists(hash_table, entry.key);
-		if(entry_found) {
+		uint32_t key_hash = hash(entry.key);
+		Entry *entry_found = findEntry(hash_table->entries, hash_table->capacity, entry.key, key_hash);
+		if(isLiveEntry(entry_found)) {
 				entry_found->value = entry.value;
+				return;
 		}
-		else {
-				int index = hash(entry.key) % hash_table->capacity;
-				entry.key = dynamicStrCpy(entry.key);
-				writeEntryArray(&hash_table->table[index], entry);
+
+		// Only a new key can make the table grow.
+		if(entry_found->key == NULL && hash_table->count + 1 > hash_table->capacity * MAX_LOAD_FACTOR) {
+				growHashTable(hash_table);
+				entry_found = findEntry(hash_table->entries, hash_table->capacity, entry.key, key_hash);
 		}
-		hash_table->count++;
+
+		// Reusing a tombstone does not change the number of used entries.
+		if(entry_found->key == NULL) hash_table->count++;
+		entry_found->key = dynamicStrCpy(entry.key);
+		entry_found->value = entry.value;
+		entry_found->hash = key_hash;
 }
 
 bool deleteHashTable(HashTable *hash_table, char *key) {
-		if(!keyExists(hash_table, key)) return false;
-
-		int index = hash(key) % hash_table->capacity;
-		EntryArray *entry_array = &hash_table->table[index];
-
-		int r = 0;
-		while(strcmp(entry_array->array[r].key, key)) r++;
-		
-		free(entry_array->array[r].key);
-		entry_array->array[r].key = entry_array->array[entry_array->count - 1].key;
-		entry_array->array[r].value = entry_array->array[entry_array->count -1].value;
+		Entry *entry = keyExists(hash_table, key);
+		if(!entry) return false;
 
-		entry_array->count--;
-		hash_table->count--;
+		free(entry->key);
+		entry->key = HASH_TABLE_TOMBSTONE;
 		return true;
 }
 
 uint32_t hash(char *key) {
 		uint32_t h = 2166136261u;
-		for(int i = 0; i < strlen(key); ++i) {
-				h ^= (uint8_t) key[i];
+		for(; *key != '\0'; ++key) {
+				h ^= (uint8_t) *key;
+				h *= 16777619;
+		}
+		return h;
+}
+
+uint32_t hashBytes(const char *bytes, int length) {
+		uint32_t h = 2166136261u;
+		for(int i = 0; i < length; ++i) {
+				h ^= (uint8_t) bytes[i];
 				h *= 16777619;
 		}
 		return h;
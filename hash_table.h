@@ -4,40 +4,57 @@
 #include "value.h"
 #include <stdint.h>
 
-#define MAX_LOAD_FACTOR 0.8
-#define INITIAL_TABLE_CAPACITY 10
+#define MAX_LOAD_FACTOR 0.75
+// Must be a power of two.
+#define INITIAL_TABLE_CAPACITY 16
 
 typedef struct HashTable HashTable;
 typedef struct Entry Entry;
-typedef struct EntryArray EntryArray;
 
 struct Entry {
 	  char *key;
 		Value value;
+		// Hash of `key`, filled by the table.
+		uint32_t hash;
 };
 
 uint32_t hash(char *key);
-
-struct EntryArray {
+// Hash of the `length` first bytes of `bytes`.
+uint32_t hashBytes(const char *bytes, int length);
+
+/*
+ * Hash table from strings to values, with open addressing in a single array of entries.
+ * The capacity is a power of two so that a hash is reduced to an index with a mask, and
+ * collisions are resolved by linear probing.
+ *
+ * A deleted entry leaves a tombstone behind, so that the probing of the other keys goes on past it.
+ * Tombstones are counted in `count` (they keep the probe sequences long) and are reused by insertions.
+ * They are dropped when the table is rebuilt, which only doubles the capacity if the live entries
+ * alone would keep it more than half as full as MAX_LOAD_FACTOR.
+ *
+ * Every entry caches the hash of its key: a resize never hashes a key again, and a probe only
+ * compares the bytes of keys whose hash is equal.
+ * */
+struct HashTable {
 		int count;
 		int capacity;
-		Entry *array;
+		Entry *entries;
 };
-void initEntryArray(EntryArray *entry_array);
-void freeEntryArray(EntryArray *entry_array);
-void writeEntryArray(EntryArray *entry_array, Entry entry);
 
+// Key of the entries that were deleted.
+extern char hash_table_tombstone;
+#define HASH_TABLE_TOMBSTONE (&hash_table_tombstone)
+
+static inline bool isLiveEntry(Entry *entry) {
+		return entry->key != NULL && entry->key != HASH_TABLE_TOMBSTONE;
+}
 
-struct HashTable {
-		int count;
-		int capacity;
-		EntryArray *table;
-};
 void initHashTable(HashTable *hash_table);
 void freeHashTable(HashTable *hash_table);
 void resize(HashTable *hash_table, int new_capacity);
 
 
+// Inserts a copy of `entry.key` with `entry.value`, or updates the value if the key already exists.
 void insertHashTable(HashTable *hash_table, Entry entry);
 bool deleteHashTable(HashTable *hash_table, char *key);
 Entry *keyExists(HashTable *hash_table, char *key);
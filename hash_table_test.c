@@ -2,7 +2,16 @@
 #include "error.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
+// Stress test of the hash table with random keys, which also reports the throughput of
+// the operations and the memory used per entry.
+
+#define LOOKUP_ROUNDS 10
+#define LONG_KEY_COUNT 1000
+#define LONG_KEY_LENGTH 4096
+#define CHURN_ROUNDS 2000000
 
 Entry createEntry(char *key, Value value) {
 		Entry e;
@@ -11,12 +20,79 @@ Entry createEntry(char *key, Value value) {
 		return e;
 }
 
+static double seconds() {
+		struct timespec time;
+		clock_gettime(CLOCK_MONOTONIC, &time);
+		return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Bytes used by the table and its copies of the keys, per key.
+static double bytesPerEntry(HashTable *hash_table, int *live_count) {
+		size_t bytes = hash_table->capacity * sizeof(Entry);
+		int count = 0;
+		for(int c = 0; c < hash_table->capacity; ++c) {
+				Entry *entry = &hash_table->entries[c];
+				if(!isLiveEntry(entry)) continue;
+				bytes += strlen(entry->key) + 1;
+				count++;
+		}
+		*live_count = count;
+		return (double) bytes / count;
+}
+
+// Keys that look like long paths, which share most of their bytes.
+static double longKeyLookups() {
+		HashTable hash_table;
+		initHashTable(&hash_table);
+
+		char **keys = malloc(LONG_KEY_COUNT * sizeof(char *));
+		for(int i = 0; i < LONG_KEY_COUNT; ++i) {
+				keys[i] = malloc(LONG_KEY_LENGTH + 1);
+				memset(keys[i], '/', LONG_KEY_LENGTH);
+				snprintf(keys[i] + LONG_KEY_LENGTH - 16, 17, "/%015d", i);
+				insertHashTable(&hash_table, createEntry(keys[i], CREATE_NUMBER(i)));
+		}
+
+		double start = seconds();
+		for(int round = 0; round < LOOKUP_ROUNDS; ++round) {
+				for(int i = 0; i < LONG_KEY_COUNT; ++i) {
+						Entry *e = keyExists(&hash_table, keys[i]);
+						CHECK(e != NULL && AS_NUMBER(e->value) == i, "Failed Test");
+				}
+		}
+		double lookup_time = seconds() - start;
+
+		CHECK(hash_table.count == LONG_KEY_COUNT, "Failed Test");
+		freeHashTable(&hash_table);
+		for(int i = 0; i < LONG_KEY_COUNT; ++i) free(keys[i]);
+		free(keys);
+		return (double) LOOKUP_ROUNDS * LONG_KEY_COUNT / lookup_time;
+}
+
+// Inserting and deleting different keys leaves tombstones behind, which must not make the table
+// grow when only a few keys are live.
+static void churn() {
+		HashTable hash_table;
+		initHashTable(&hash_table);
+		insertHashTable(&hash_table, createEntry("live", CREATE_NUMBER(0)));
+
+		char key[32];
+		for(int i = 0; i < CHURN_ROUNDS; ++i) {
+				snprintf(key, sizeof(key), "churn%d", i);
+				insertHashTable(&hash_table, createEntry(key, CREATE_NUMBER(i)));
+				CHECK(deleteHashTable(&hash_table, key), "Failed Test");
+		}
+		CHECK(hash_table.capacity <= 4 * INITIAL_TABLE_CAPACITY, "Failed Test");
+		CHECK(keyExists(&hash_table, "live") != NULL, "Failed Test");
+		freeHashTable(&hash_table);
+}
+
 int main(int argc, char **argv) {
 		HashTable hash_table;
 		initHashTable(&hash_table);
 		const int n = 100000;
 
-		char *arr[n];
+		char **arr = malloc(n * sizeof(char *));
 
 		for(int i = 0; i < n; ++i) {
 				char alphabet[] = "abcdefghijklmnopqrstuvwxyz";
@@ -29,21 +105,51 @@ int main(int argc, char **argv) {
 				}
 				random_string[size] = '\0';
 				arr[i] = random_string;
-				insertHashTable(&hash_table, createEntry(random_string, CREATE_NUMBER(size)));
 		}
 
+		double start = seconds();
 		for(int i = 0; i < n; ++i) {
-				Entry *e = keyExists(&hash_table, arr[i]);
-				CHECK(e != NULL, arr[i]);
+				insertHashTable(&hash_table, createEntry(arr[i], CREATE_NUMBER(i)));
 		}
+		double insert_time = seconds() - start;
+
+		start = seconds();
+		for(int round = 0; round < LOOKUP_ROUNDS; ++round) {
+				for(int i = 0; i < n; ++i) {
+						Entry *e = keyExists(&hash_table, arr[i]);
+						CHECK(e != NULL, arr[i]);
+				}
+		}
+		double lookup_time = seconds() - start;
+
+		// Updating existing keys must not make the table grow.
+		int capacity = hash_table.capacity;
+		int count = hash_table.count;
+		for(int i = 0; i < n; ++i) {
+				insertHashTable(&hash_table, createEntry(arr[i], CREATE_NUMBER(-i)));
+		}
+		CHECK(hash_table.capacity == capacity && hash_table.count == count, "Failed Test");
+
+		churn();
+
+		int live_count;
+		double bytes_per_entry = bytesPerEntry(&hash_table, &live_count);
 
+		start = seconds();
 		for(int i = n - 10; i >= 0; --i) {
 				deleteHashTable(&hash_table, arr[i]);
 				CHECK(keyExists(&hash_table, arr[i]) == NULL, "Failed Test");
 		}
+		double delete_time = seconds() - start;
 
 		freeHashTable(&hash_table);
 		for(int i = 0; i < n; ++i) free(arr[i]);
+		free(arr);
 
+		printf("inserts: %.1f M/s\n", n / insert_time / 1e6);
+		printf("lookups: %.1f M/s\n", (double) LOOKUP_ROUNDS * n / lookup_time / 1e6);
+		printf("deletes: %.1f M/s\n", n / delete_time / 1e6);
+		printf("lookups of %d byte keys: %.1f K/s\n", LONG_KEY_LENGTH, longKeyLookups() / 1e3);
+		printf("memory: %.1f bytes per entry (%d keys)\n", bytes_per_entry, live_count);
 		printf("Tests Succeeded!\n");
 }
@@ -0,0 +1,522 @@
+#include "ir.h"
+#include "error.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+void initInstructionArray(InstructionArray *instructions) {
+		instructions->count = 0;
+		instructions->capacity = 0;
+		instructions->array = NULL;
+		instructions->label_count = 0;
+		instructions->variable_count = 0;
+}
+
+void freeInstructionArray(InstructionArray *instructions) {
+		free(instructions->array);
+		initInstructionArray(instructions);
+}
+
+void writeInstructionArray(InstructionArray *instructions, Instruction instruction) {
+		if(instructions->count + 1 > instructions->capacity) {
+				instructions->capacity = instructions->capacity > 0 ? 2 * instructions->capacity : 64;
+				instructions->array = realloc(instructions->array, sizeof(Instruction) * instructions->capacity);
+				CHECK(instructions->array != NULL, "Failed to allocate memory");
+		}
+		instructions->array[instructions->count++] = instruction;
+}
+
+void moveInstructionsToEnd(InstructionArray *instructions, int start, int end) {
+		int count = end - start;
+		if(count == 0 || end == instructions->count) return;
+		Instruction *moved = malloc(sizeof(Instruction) * count);
+		CHECK(moved != NULL, "Failed to allocate memory");
+		memcpy(moved, &instructions->array[start], sizeof(Instruction) * count);
+		memmove(&instructions->array[start], &instructions->array[end], sizeof(Instruction) * (instructions->count - end));
+		memcpy(&instructions->array[instructions->count - count], moved, sizeof(Instruction) * count);
+		free(moved);
+}
+
+bool foldBinaryOperation(OpCode op_code, Value lhs, Value rhs, Value *result) {
+		if(op_code == OP_EQUAL_EQUAL || op_code == OP_BANG_EQUAL) {
+				*result = CREATE_BOOLEAN(valueEquals(&lhs, &rhs) == (op_code == OP_EQUAL_EQUAL));
+				return true;
+		}
+		if(op_code == OP_ADD && IS_STRING(lhs) && IS_STRING(rhs)) {
+				*result = CREATE_STRING(concatenateStrings(AS_STRING(lhs), AS_STRING(rhs)));
+				return true;
+		}
+		if(!IS_NUMBER(lhs) || !IS_NUMBER(rhs)) return false;
+
+		double a = AS_NUMBER(lhs), b = AS_NUMBER(rhs);
+		switch(op_code) {
+				case OP_ADD: *result = CREATE_NUMBER(a + b); return true;
+				case OP_SUBSTRACT: *result = CREATE_NUMBER(a - b); return true;
+				case OP_MULTIPLY: *result = CREATE_NUMBER(a * b); return true;
+				case OP_DIVIDE: *result = CREATE_NUMBER(a / b); return true;
+				case OP_LESS: *result = CREATE_BOOLEAN(a < b); return true;
+				case OP_LESS_EQUAL: *result = CREATE_BOOLEAN(a <= b); return true;
+				case OP_GREATER: *result = CREATE_BOOLEAN(a > b); return true;
+				case OP_GREATER_EQUAL: *result = CREATE_BOOLEAN(a >= b); return true;
+				default: return false;
+		}
+}
+
+bool foldUnaryOperation(OpCode op_code, Value operand, Value *result) {
+		if(op_code == OP_NEGATE && IS_NUMBER(operand)) {
+				*result = CREATE_NUMBER(-AS_NUMBER(operand));
+				return true;
+		}
+		if(op_code == OP_NOT && IS_BOOLEAN(operand)) {
+				*result = CREATE_BOOLEAN(!AS_BOOLEAN(operand));
+				return true;
+		}
+		return false;
+}
+
+static bool isBinaryOperation(int op) {
+		switch(op) {
+				case OP_ADD: case OP_SUBSTRACT: case OP_MULTIPLY: case OP_DIVIDE:
+				case OP_LESS: case OP_LESS_EQUAL: case OP_GREATER: case OP_GREATER_EQUAL:
+				case OP_EQUAL_EQUAL: case OP_BANG_EQUAL:
+						return true;
+				default:
+						return false;
+		}
+}
+
+// Instructions that only push a value, and can be removed along with the OP_POP of the value.
+static bool isPurePush(int op) {
+		return op == OP_VALUE || op == OP_GET_LOCAL || op == OP_GET_GLOBAL;
+}
+
+/*
+ * The passes rewrite the instructions in place: `kept` instructions are moved to the front of the
+ * array as they are read, and a rewrite looks at the last kept ones. Each pass returns whether it
+ * changed anything.
+ * */
+
+// Folds operators whose operands are constants, removes constants and variable reads that are
+// popped right away, and replaces the conditional jumps on a constant by an unconditional jump or
+// by nothing.
+static bool foldConstants(InstructionArray *instructions, ValueArray *constants) {
+		Instruction *array = instructions->array;
+		int kept = 0;
+		bool changed = false;
+		for(int i = 0; i < instructions->count; ++i) {
+				Instruction instruction = array[i];
+				Instruction *last = kept > 0 ? &array[kept - 1] : NULL;
+				Instruction *before_last = kept > 1 ? &array[kept - 2] : NULL;
+				Value result;
+
+				if(isBinaryOperation(instruction.op) && before_last != NULL && last->op == OP_VALUE &&
+						before_last->op == OP_VALUE && foldBinaryOperation(instruction.op,
+								constants->array[before_last->operand], constants->array[last->operand], &result))
+				{
+						before_last->operand = writeValueArray(constants, result);
+						kept--;
+						changed = true;
+						continue;
+				}
+				if((instruction.op == OP_NEGATE || instruction.op == OP_NOT) && last != NULL && last->op == OP_VALUE &&
+						foldUnaryOperation(instruction.op, constants->array[last->operand], &result))
+				{
+						last->operand = writeValueArray(constants, result);
+						changed = true;
+						continue;
+				}
+				if(instruction.op == OP_POP && last != NULL && isPurePush(last->op)) {
+						kept--;
+						changed = true;
+						continue;
+				}
+				if((instruction.op == OP_JUMP_IF_FALSE || instruction.op == OP_JUMP_BACKWARD_IF_TRUE) && last != NULL &&
+						last->op == OP_VALUE)
+				{
+						bool jumps = isTrue(constants->array[last->operand]) == (instruction.op == OP_JUMP_BACKWARD_IF_TRUE);
+						if(jumps) *last = (Instruction) { OP_JUMP, instruction.operand, -1, -1 };
+						else kept--;
+						changed = true;
+						continue;
+				}
+				// The jumps of `and` and `or` keep the constant, which is popped by the next operand
+				// when they do not jump.
+				if((instruction.op == OP_JUMP_IF_FALSE_NO_POP || instruction.op == OP_JUMP_IF_TRUE_NO_POP) &&
+						last != NULL && last->op == OP_VALUE)
+				{
+						bool jumps = isTrue(constants->array[last->operand]) == (instruction.op == OP_JUMP_IF_TRUE_NO_POP);
+						if(jumps) array[kept++] = (Instruction) { OP_JUMP, instruction.operand, -1, -1 };
+						changed = true;
+						continue;
+				}
+				array[kept++] = instruction;
+		}
+		instructions->count = kept;
+		return changed;
+}
+
+// Returns the position of every label in the instructions (-1 for the labels that were removed).
+static int *findLabels(InstructionArray *instructions) {
+		int *labels = malloc(sizeof(int) * (instructions->label_count + 1));
+		CHECK(labels != NULL, "Failed to allocate memory");
+		for(int i = 0; i < instructions->label_count; ++i) labels[i] = -1;
+		for(int i = 0; i < instructions->count; ++i) {
+				if(instructions->array[i].op == IR_LABEL) labels[instructions->array[i].operand] = i;
+		}
+		return labels;
+}
+
+static bool isJump(int op) {
+		return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_BACKWARD_IF_TRUE ||
+				op == OP_JUMP_IF_FALSE_NO_POP || op == OP_JUMP_IF_TRUE_NO_POP;
+}
+
+// Removes the instructions that can not be reached from the start of the function, the jumps to
+// the next instruction and the labels that no jump refers to.
+// Only the removal of jumps and labels can make two instructions adjacent (the reachable code that
+// follows unreachable code starts with a label), so that is what the return value tells.
+static bool removeDeadCode(InstructionArray *instructions) {
+		Instruction *array = instructions->array;
+		int count = instructions->count;
+		int *labels = findLabels(instructions);
+
+		// Walk the control flow from the first instruction.
+		bool *reachable = calloc(count + 1, sizeof(bool));
+		int *worklist = malloc(sizeof(int) * (count + 1));
+		CHECK(reachable != NULL && worklist != NULL, "Failed to allocate memory");
+		int worklist_size = 0;
+		if(count > 0) {
+				reachable[0] = true;
+				worklist[worklist_size++] = 0;
+		}
+		while(worklist_size > 0) {
+				int i = worklist[--worklist_size];
+				int successors[2];
+				int successor_count = 0;
+				if(isJump(array[i].op)) successors[successor_count++] = labels[array[i].operand];
+				if(array[i].op != OP_JUMP && array[i].op != OP_RETURN && i + 1 < count) successors[successor_count++] = i + 1;
+
+				for(int j = 0; j < successor_count; ++j) {
+						if(reachable[successors[j]]) continue;
+						reachable[successors[j]] = true;
+						worklist[worklist_size++] = successors[j];
+				}
+		}
+
+		int kept = 0;
+		for(int i = 0; i < count; ++i) {
+				if(reachable[i]) array[kept++] = array[i];
+		}
+		count = kept;
+		free(reachable);
+		free(worklist);
+
+		// A jump to the labels right after it does nothing (but pop its condition, if it does).
+		bool changed = false;
+		kept = 0;
+		for(int i = 0; i < count; ++i) {
+				Instruction instruction = array[i];
+				if(isJump(instruction.op)) {
+						int next = i + 1;
+						while(next < count && array[next].op == IR_LABEL && array[next].operand != instruction.operand) next++;
+						if(next < count && array[next].op == IR_LABEL) {
+								changed = true;
+								if(instruction.op == OP_JUMP || instruction.op == OP_JUMP_IF_FALSE_NO_POP ||
+										instruction.op == OP_JUMP_IF_TRUE_NO_POP) continue;
+								instruction = (Instruction) { OP_POP, 0, -1, -1 };
+						}
+				}
+				array[kept++] = instruction;
+		}
+		count = kept;
+
+		// Labels that are not the target of any jump only get in the way of the other rewrites.
+		bool *used = calloc(instructions->label_count + 1, sizeof(bool));
+		CHECK(used != NULL, "Failed to allocate memory");
+		for(int i = 0; i < count; ++i) {
+				if(isJump(array[i].op)) used[array[i].operand] = true;
+		}
+		kept = 0;
+		for(int i = 0; i < count; ++i) {
+				if(array[i].op == IR_LABEL && !used[array[i].operand]) {
+						changed = true;
+						continue;
+				}
+				array[kept++] = array[i];
+		}
+		instructions->count = kept;
+		free(used);
+		free(labels);
+		return changed;
+}
+
+/*
+ * Local variables that are never assigned after their declaration keep their initial value for
+ * their whole scope. If that value is a constant, the reads of the variable are replaced by the
+ * constant (constant propagation). If it is the value of another local variable that is never
+ * assigned either, which is still in scope since it was declared first, they are replaced by reads
+ * of that variable (copy propagation). Parameters are never assigned by the caller, so they can be
+ * the source of a copy.
+ * Variables are only shared by the code of a function (there are no closures), so the function
+ * sees all their assignments.
+ * */
+static bool propagateVariables(InstructionArray *instructions) {
+		Instruction *array = instructions->array;
+		int variable_count = instructions->variable_count;
+
+		bool *assigned = calloc(variable_count + 1, sizeof(bool));
+		// Instruction that replaces the reads of each variable, if any.
+		Instruction *replacement = malloc(sizeof(Instruction) * (variable_count + 1));
+		CHECK(assigned != NULL && replacement != NULL, "Failed to allocate memory");
+		for(int i = 0; i < instructions->count; ++i) {
+				if(array[i].op == OP_SET_LOCAL) assigned[array[i].variable] = true;
+		}
+		for(int i = 0; i < variable_count; ++i) replacement[i].op = IR_LABEL;
+
+		// Variables are declared before they are read, so a single walk resolves chains of copies.
+		bool changed = false;
+		for(int i = 0; i < instructions->count; ++i) {
+				Instruction *instruction = &array[i];
+				if(instruction->op == OP_GET_LOCAL && replacement[instruction->variable].op != IR_LABEL) {
+						*instruction = replacement[instruction->variable];
+						changed = true;
+				}
+				else if(instruction->op == IR_DEFINE_LOCAL && i > 0 && !assigned[instruction->variable]) {
+						// No label sits between the value and the declaration, so it is the initial value.
+						Instruction value = array[i - 1];
+						bool is_copy = value.op == OP_GET_LOCAL && !assigned[value.variable];
+						if(value.op == OP_VALUE || is_copy) replacement[instruction->variable] = value;
+				}
+		}
+		free(assigned);
+		free(replacement);
+		return changed;
+}
+
+/*
+ * Superinstructions do the work of a common sequence of instructions in a single dispatch:
+ *   + OP_SET_LOCAL/OP_SET_GLOBAL, OP_POP (an assignment statement) -> OP_SET_LOCAL_POP/OP_SET_GLOBAL_POP.
+ *   + OP_GET_x, OP_VALUE, OP_ADD/OP_SUBSTRACT, OP_SET_x, OP_POP on the same variable (e.g `i = i + 1;`)
+ *     -> OP_INC_x, which adds the constant (negated for a subtraction) to the variable.
+ *   + OP_VALUE, OP_LESS, OP_JUMP_IF_FALSE/OP_JUMP_BACKWARD_IF_TRUE (e.g the condition `i < 10`)
+ *     -> OP_LESS_CONST_JUMP_IF_FALSE/OP_LESS_CONST_JUMP_BACKWARD_IF_TRUE.
+ * The constant must be a number, so that the VM only checks the type of the variable. Sequences
+ * never contain labels, which sit between instructions, so no jump lands in the middle of one.
+ * The other passes do not know superinstructions, so this one runs last.
+ * */
+static void fuseInstructions(InstructionArray *instructions, ValueArray *constants) {
+		Instruction *array = instructions->array;
+		int kept = 0;
+		for(int i = 0; i < instructions->count; ++i) {
+				Instruction instruction = array[i];
+				Instruction *last = kept > 0 ? &array[kept - 1] : NULL;
+
+				if(instruction.op == OP_POP && last != NULL && (last->op == OP_SET_LOCAL || last->op == OP_SET_GLOBAL)) {
+						bool is_local = last->op == OP_SET_LOCAL;
+						Instruction *get = kept > 3 ? &array[kept - 4] : NULL;
+						Instruction *value = kept > 3 ? &array[kept - 3] : NULL;
+						int operator = kept > 3 ? array[kept - 2].op : -1;
+						if(get != NULL && get->op == (is_local ? OP_GET_LOCAL : OP_GET_GLOBAL) &&
+								get->operand == last->operand && value->op == OP_VALUE &&
+								IS_NUMBER(constants->array[value->operand]) && (operator == OP_ADD || operator == OP_SUBSTRACT))
+						{
+								double increment = AS_NUMBER(constants->array[value->operand]);
+								int constant = operator == OP_ADD ? value->operand :
+										writeValueArray(constants, CREATE_NUMBER(-increment));
+								if(constant <= UINT16_MAX) {
+										*get = (Instruction) { is_local ? OP_INC_LOCAL : OP_INC_GLOBAL, last->operand, last->variable, constant };
+										kept -= 3;
+										continue;
+								}
+						}
+						last->op = is_local ? OP_SET_LOCAL_POP : OP_SET_GLOBAL_POP;
+						continue;
+				}
+				if((instruction.op == OP_JUMP_IF_FALSE || instruction.op == OP_JUMP_BACKWARD_IF_TRUE) && kept > 1 &&
+						last->op == OP_LESS && array[kept - 2].op == OP_VALUE && array[kept - 2].operand <= UINT16_MAX &&
+						IS_NUMBER(constants->array[array[kept - 2].operand]))
+				{
+						int op = instruction.op == OP_JUMP_IF_FALSE ? OP_LESS_CONST_JUMP_IF_FALSE : OP_LESS_CONST_JUMP_BACKWARD_IF_TRUE;
+						array[kept - 2] = (Instruction) { op, instruction.operand, -1, array[kept - 2].operand };
+						kept--;
+						continue;
+				}
+				array[kept++] = instruction;
+		}
+		instructions->count = kept;
+}
+
+void optimizeInstructions(InstructionArray *instructions, ValueArray *constants, int level) {
+		if(level <= 0) return;
+
+		if(level >= 2) propagateVariables(instructions);
+		// Dead code elimination can open opportunities for folding (e.g a removed label lets two
+		// constants meet) and folding for dead code elimination (e.g a constant branch), so they run
+		// until they do not find anything new.
+		bool changed = true;
+		while(changed) {
+				foldConstants(instructions, constants);
+				changed = removeDeadCode(instructions);
+		}
+		fuseInstructions(instructions, constants);
+}
+
+// Number of bytes of the bytecode of an instruction.
+static int instructionSize(Instruction *instruction) {
+		switch(instruction->op) {
+				case IR_LABEL:
+				case IR_DEFINE_LOCAL:
+						return 0;
+				case OP_VALUE:
+						return instruction->operand <= UINT8_MAX ? 2 : 4;
+				case OP_CALL:
+						return 2;
+				case OP_JUMP:
+				case OP_JUMP_IF_FALSE:
+				case OP_JUMP_BACKWARD_IF_TRUE:
+				case OP_JUMP_IF_FALSE_NO_POP:
+				case OP_JUMP_IF_TRUE_NO_POP:
+				case OP_GET_LOCAL:
+				case OP_SET_LOCAL:
+				case OP_GET_GLOBAL:
+				case OP_SET_GLOBAL:
+				case OP_DEFINE_GLOBAL:
+				case OP_SET_LOCAL_POP:
+				case OP_SET_GLOBAL_POP:
+						return 3;
+				case OP_INC_LOCAL:
+				case OP_INC_GLOBAL:
+				case OP_LESS_CONST_JUMP_IF_FALSE:
+				case OP_LESS_CONST_JUMP_BACKWARD_IF_TRUE:
+						return 5;
+				default:
+						return 1;
+		}
+}
+
+// Superinstructions that load a constant, whose position in the constant pool is in `constant`.
+static bool hasConstantOperand(int op) {
+		return op == OP_INC_LOCAL || op == OP_INC_GLOBAL || op == OP_LESS_CONST_JUMP_IF_FALSE ||
+				op == OP_LESS_CONST_JUMP_BACKWARD_IF_TRUE;
+}
+
+static void writeShort(ByteArray *code, int operand) {
+		writeByteArray(code, (operand >> 8) & 0xff);
+		writeByteArray(code, operand & 0xff);
+}
+
+void lowerInstructions(InstructionArray *instructions, Function *function) {
+		// Keep only the constants that are still loaded, so that most of them fit in one byte operands.
+		int *positions = malloc(sizeof(int) * (function->constants.count + 1));
+		CHECK(positions != NULL, "Failed to allocate memory");
+		for(int i = 0; i < function->constants.count; ++i) positions[i] = -1;
+		for(int i = 0; i < instructions->count; ++i) {
+				Instruction *instruction = &instructions->array[i];
+				if(instruction->op == OP_VALUE) positions[instruction->operand] = 0;
+				else if(hasConstantOperand(instruction->op)) positions[instruction->constant] = 0;
+		}
+		compactValueArray(&function->constants, positions);
+		CHECK(function->constants.count <= (1 << 24), "Too many constants in one function");
+		for(int i = 0; i < instructions->count; ++i) {
+				Instruction *instruction = &instructions->array[i];
+				if(instruction->op == OP_VALUE) instruction->operand = positions[instruction->operand];
+				else if(hasConstantOperand(instruction->op)) instruction->constant = positions[instruction->constant];
+		}
+		free(positions);
+
+		// Labels take the offset of the next instruction.
+		int *offsets = malloc(sizeof(int) * (instructions->label_count + 1));
+		CHECK(offsets != NULL, "Failed to allocate memory");
+		int offset = 0;
+		for(int i = 0; i < instructions->count; ++i) {
+				if(instructions->array[i].op == IR_LABEL) offsets[instructions->array[i].operand] = offset;
+				offset += instructionSize(&instructions->array[i]);
+		}
+
+		ByteArray *code = &function->code;
+		for(int i = 0; i < instructions->count; ++i) {
+				Instruction *instruction = &instructions->array[i];
+				int op = instruction->op;
+				int position = code->count;
+				switch(op) {
+						case IR_LABEL:
+						case IR_DEFINE_LOCAL:
+								break;
+						// Constants are loaded with a one byte operand when possible and with a three
+						// bytes operand (big endian) otherwise.
+						case OP_VALUE:
+								if(instruction->operand <= UINT8_MAX) {
+										writeByteArray(code, OP_VALUE);
+										writeByteArray(code, instruction->operand);
+										break;
+								}
+								writeByteArray(code, OP_CONSTANT_LONG);
+								writeByteArray(code, (instruction->operand >> 16) & 0xff);
+								writeShort(code, instruction->operand & 0xffff);
+								break;
+						// Jump sizes are relative to the position of the jump opcode. Unconditional jumps go
+						// either way, OP_JUMP_BACKWARD_IF_TRUE only goes backward and the other conditional
+						// jumps only forward.
+						case OP_JUMP:
+						case OP_JUMP_IF_FALSE:
+						case OP_JUMP_IF_FALSE_NO_POP:
+						case OP_JUMP_IF_TRUE_NO_POP: {
+								int target = offsets[instruction->operand];
+								if(target <= position) {
+										CHECK(op == OP_JUMP, "Conditional jumps can only go forward");
+										CHECK(position - target <= UINT16_MAX, "Too much code to jump over");
+										writeByteArray(code, OP_JUMP_BACKWARD);
+										writeShort(code, position - target);
+								}
+								else {
+										CHECK(target - position <= UINT16_MAX, "Too much code to jump over");
+										writeByteArray(code, op);
+										writeShort(code, target - position);
+								}
+								break;
+						}
+						case OP_JUMP_BACKWARD_IF_TRUE: {
+								int target = offsets[instruction->operand];
+								CHECK(target <= position, "Loop conditions can only jump backward");
+								CHECK(position - target <= UINT16_MAX, "Too much code to jump over");
+								writeByteArray(code, op);
+								writeShort(code, position - target);
+								break;
+						}
+						case OP_LESS_CONST_JUMP_BACKWARD_IF_TRUE: {
+								int target = offsets[instruction->operand];
+								CHECK(target <= position, "Loop conditions can only jump backward");
+								CHECK(position - target <= UINT16_MAX, "Too much code to jump over");
+								writeByteArray(code, op);
+								writeShort(code, instruction->constant);
+								writeShort(code, position - target);
+								break;
+						}
+						case OP_LESS_CONST_JUMP_IF_FALSE: {
+								int target = offsets[instruction->operand];
+								CHECK(target > position, "Conditional jumps can only go forward");
+								CHECK(target - position <= UINT16_MAX, "Too much code to jump over");
+								writeByteArray(code, op);
+								writeShort(code, instruction->constant);
+								writeShort(code, target - position);
+								break;
+						}
+						case OP_INC_LOCAL:
+						case OP_INC_GLOBAL:
+								writeByteArray(code, op);
+								writeShort(code, instruction->operand);
+								writeShort(code, instruction->constant);
+								break;
+						case OP_CALL:
+								writeByteArray(code, op);
+								writeByteArray(code, instruction->operand);
+								break;
+						default:
+								writeByteArray(code, op);
+								if(instructionSize(instruction) == 3) writeShort(code, instruction->operand);
+								break;
+				}
+		}
+		free(offsets);
+}
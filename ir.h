@@ -0,0 +1,80 @@
+#ifndef COMPILER_IR_H
+#define COMPILER_IR_H
+
+#include "value.h"
+#include "vm.h"
+#include <stdbool.h>
+
+/*
+ * Intermediate representation of the code of a function, between the parser and the bytecode.
+ *
+ * The parser writes a list of instructions that mirrors the bytecode, except that:
+ *   + jumps refer to labels, which are pseudo instructions placed anywhere in the list, instead of
+ *     byte offsets. Instructions can be removed, moved or rewritten without fixing any jump.
+ *   + operands are not encoded: constants are loaded by OP_VALUE whatever their position in the
+ *     constant pool, and OP_JUMP goes backward or forward.
+ *   + accesses to local variables also record which declaration they refer to (slots are reused
+ *     by the variables of different scopes), and IR_DEFINE_LOCAL marks where a local variable gets
+ *     its initial value: the value on top of the stack.
+ * Optimization passes run over the list, which is then lowered to the bytecode of the function.
+ * */
+
+// Pseudo instructions, which are not written to the bytecode.
+enum {
+		IR_LABEL = -1,
+		IR_DEFINE_LOCAL = -2
+};
+
+typedef struct {
+		// OpCode, or one of the pseudo instructions.
+		int op;
+		// Position in the constant pool (OP_VALUE), slot of a variable, arity (OP_CALL) or label
+		// (jumps and IR_LABEL).
+		int operand;
+		// Declaration of the local variable of the instructions on local variables and IR_DEFINE_LOCAL,
+		// -1 otherwise.
+		int variable;
+		// Position in the constant pool of the constant that superinstructions take as a second operand,
+		// -1 otherwise.
+		int constant;
+} Instruction;
+
+typedef struct {
+		int count;
+		int capacity;
+		Instruction *array;
+		// Number of labels and of local variable declarations, which are numbered from 0.
+		int label_count;
+		int variable_count;
+} InstructionArray;
+
+void initInstructionArray(InstructionArray *instructions);
+void freeInstructionArray(InstructionArray *instructions);
+void writeInstructionArray(InstructionArray *instructions, Instruction instruction);
+// Moves the instructions in [start, end) after all the others, e.g to put the condition of a loop
+// after its body.
+void moveInstructionsToEnd(InstructionArray *instructions, int start, int end);
+
+/*
+ * Optimization levels:
+ *   + 0: the bytecode follows the source.
+ *   + 1: constant folding (also done by the parser as it goes), constant branches and dead code
+ *        elimination, then the common sequences of instructions are fused into superinstructions.
+ *   + 2: constant and copy propagation of the local variables that are never assigned, followed by the
+ *        passes of level 1 to clean up after them.
+ * */
+#ifndef DEFAULT_OPTIMIZATION_LEVEL
+#define DEFAULT_OPTIMIZATION_LEVEL 1
+#endif
+
+void optimizeInstructions(InstructionArray *instructions, ValueArray *constants, int level);
+
+// Writes the bytecode of `function` from `instructions`, and keeps only the constants it uses.
+void lowerInstructions(InstructionArray *instructions, Function *function);
+
+// Evaluate an operator on constants like the VM does. They return false if the VM would raise an
+// error instead, so that the error still happens at runtime.
+bool foldBinaryOperation(OpCode op_code, Value lhs, Value rhs, Value *result);
+bool foldUnaryOperation(OpCode op_code, Value operand, Value *result);
+
+#endif
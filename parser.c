@@ -2,14 +2,23 @@
 #include "error.h"
 #include "value.h"
 #include "debug.h"
+#include "ir.h"
 #include "utility.h"
 #include "vm.h"
+#include <math.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 
+// Position in the instructions and in the constant pool of the current function where the code of an
+// operand starts, so that it can be inspected and rewritten once compiled.
+typedef struct {
+	int code;
+	int constant_count;
+} OperandStart;
+
 // Forward declaration of static helper functions.
 static Token *eatToken();
 static Token *peekToken();
@@ -33,23 +42,108 @@ static void funDeclaration();
 static void ifStatement();
 static bool matchAndEatToken(TokenType type);
 static Token *eatTokenOrReturnError(TokenType type, const char *message);
-static int setCheckPoint(OpCode op_code);
-static void setJumpSize(int jump);
+static int writeJump(OpCode op_code);
+static void writeJumpTo(OpCode op_code, int label);
+static int placeLabel(int label);
 static bool reachedEOF();
-static bool stringEquals();
-static char *dynamicStrCpy(char *s);
-static int resolveLocal(char *lexeme);
-static void defineVariable(char *lexeme);
+static bool identifierEquals(Token *identifier, const char *name);
+static char *copyLexeme(Token *token);
+static char *lexemeText(Token *token);
+static int resolveVariable(Token *identifier);
+static int globalSlot(Token *identifier);
+static void defineVariable(Token *identifier);
 static void initializeVariable();
+static void writeDefineLocal();
 static void returnStatement();
+static void writeOpCode(OpCode op_code);
+static void writeConstant(int pos_on_value_array);
+static void writeShortOperand(int operand);
+static void updateStackDepth(int delta);
+static void writeBinaryOperation(OpCode op_code, OperandStart left, OperandStart right,
+		bool left_number, bool right_number);
+static void writeUnaryOperation(OpCode op_code, OperandStart operand);
+static OperandStart operandStart();
+static void discardCode(OperandStart start, int values);
+static void finishFunction(Function *function);
 
 Parser parser;
 Function *current_function;
 Function *global_function;
 
+// Instructions of the function being compiled (see ir.h), lowered to its bytecode once the whole
+// function is parsed.
+static InstructionArray *current_code;
+
+static int optimization_level = DEFAULT_OPTIMIZATION_LEVEL;
+
+// Whether the declaration of the global variable in each slot of `vm.globals` was compiled.
+// A slot can be given to a name before its declaration, when a function uses a global that is
+// declared later.
+static ByteArray defined_globals;
+
+// Whether the expression that was just compiled is known to evaluate to a number, or to fail at
+// runtime before producing a value. Arithmetic identities are only simplified on such operands.
+static bool known_number;
+
+// Memory used only while compiling (e.g the names of the local variables), released at the end of parse().
+static Arena compile_arena;
+
+// Net effect of each instruction on the number of values on the stack.
+// OP_CALL also pops its arguments, which is accounted for in `call()`.
+static const int stack_effect[] = {
+	[OP_ADD] = -1,
+	[OP_SUBSTRACT] = -1,
+	[OP_NEGATE] = 0,
+	[OP_JUMP_IF_FALSE] = -1,
+	[OP_JUMP_BACKWARD] = 0,
+	[OP_CALL] = 0,
+	[OP_JUMP] = 0,
+	[OP_NOT] = 0,
+	[OP_MULTIPLY] = -1,
+	[OP_CHECK_REFLEXIVE_ASSIGNMENT] = 0,
+	[OP_DIVIDE] = -1,
+	[OP_PRINT] = -1,
+	[OP_SET_LOCAL] = 0,
+	[OP_RETURN] = -1,
+	[OP_VALUE] = 1,
+	[OP_GET_GLOBAL] = 1,
+	[OP_SET_GLOBAL] = 0,
+	[OP_LESS] = -1,
+	[OP_SET] = 0,
+	[OP_GET_LOCAL] = 1,
+	[OP_LESS_EQUAL] = -1,
+	[OP_POP] = -1,
+	[OP_GREATER] = -1,
+	[OP_GREATER_EQUAL] = -1,
+	[OP_EQUAL_EQUAL] = -1,
+	[OP_BANG_EQUAL] = -1,
+	[OP_CONSTANT_LONG] = 1,
+	[OP_DEFINE_GLOBAL] = -1,
+	[OP_JUMP_BACKWARD_IF_TRUE] = -1,
+	[OP_JUMP_IF_FALSE_NO_POP] = 0,
+	[OP_JUMP_IF_TRUE_NO_POP] = 0,
+	// Superinstructions are only written by the optimizer, after the stack depth is known. They
+	// never need more stack than the instructions they replace.
+	[OP_SET_LOCAL_POP] = -1,
+	[OP_SET_GLOBAL_POP] = -1,
+	[OP_INC_LOCAL] = 0,
+	[OP_INC_GLOBAL] = 0,
+	[OP_LESS_CONST_JUMP_IF_FALSE] = -1,
+	[OP_LESS_CONST_JUMP_BACKWARD_IF_TRUE] = -1,
+	// Only written by the VM.
+	[OP_ADD_NUM] = -1,
+	[OP_ADD_STR] = -1,
+	[OP_EQUAL_EQUAL_NUM] = -1,
+	[OP_BANG_EQUAL_NUM] = -1
+};
+
+void setOptimizationLevel(int level) {
+	optimization_level = level;
+}
+
 void initParser(Parser *parser) {
-	parser->previous = NULL;
-	parser->current = 0;
+	initToken(&parser->previous, TOKEN_UNINITIALIZED, NULL, 0, -1);
+	initToken(&parser->current, TOKEN_UNINITIALIZED, NULL, 0, -1);
 }
 
 void freeParser(Parser *parser) {
@@ -63,20 +157,20 @@ static Token *eatTokenOrReturnError(TokenType type, const char *message) {
 	return eatToken();
 }
 
-// Stores the most recent token in the field `parser.previous` and advances the current index.
-// `parser.current` index always points at the token that is about to be parsed.
+// Stores the most recent token in the field `parser.previous` and scans the next one.
+// `parser.current` always holds the token that is about to be parsed.
 static Token *eatToken() {
-	parser.previous = &tokenizer.token_array.array[parser.current];
-	parser.current++;
-	return &tokenizer.token_array.array[parser.current - 1];
+	parser.previous = parser.current;
+	parser.current = scanToken();
+	return &parser.previous;
 }
 
 static Token *peekToken() {
-	return &tokenizer.token_array.array[parser.current];
+	return &parser.current;
 }
 
 static bool reachedEOF() {
-	return tokenizer.token_array.array[parser.current].type == TOKEN_EOF;
+	return parser.current.type == TOKEN_EOF;
 }
 
 // Checks whether the current token type matches the type passed in as a parameter.
@@ -88,8 +182,175 @@ static bool matchAndEatToken(TokenType type) {
 	return true;
 }
 
-static bool stringEquals(char *s, const char *t) {
-	return strcmp(s, t) == 0;
+// Keeps track of the number of values the current function has on the stack at this point of
+// the bytecode, and of the maximum it ever reaches. The VM uses `max_stack_depth` to reserve the
+// stack space of a function once when calling it, instead of checking on every push.
+static void updateStackDepth(int delta) {
+	current_function->stack_depth += delta;
+	if(current_function->stack_depth > current_function->max_stack_depth) {
+		current_function->max_stack_depth = current_function->stack_depth;
+	}
+}
+
+static Instruction *lastInstruction() {
+	return &current_code->array[current_code->count - 1];
+}
+
+static void writeOpCode(OpCode op_code) {
+	writeInstructionArray(current_code, (Instruction) { op_code, 0, -1, -1 });
+	updateStackDepth(stack_effect[op_code]);
+}
+
+// Loads the constant at `pos_on_value_array` in the constant pool.
+static void writeConstant(int pos_on_value_array) {
+	writeOpCode(OP_VALUE);
+	lastInstruction()->operand = pos_on_value_array;
+}
+
+// Sets the 16-bit operand of the last instruction, e.g the slot of a variable.
+static void writeShortOperand(int operand) {
+	CHECK(operand <= UINT16_MAX, "Too many variables in one function");
+	lastInstruction()->operand = operand;
+}
+
+// Jumps go to labels, which are placed in the instructions once their position is known.
+static int newLabel() {
+	return current_code->label_count++;
+}
+
+static int placeLabel(int label) {
+	writeInstructionArray(current_code, (Instruction) { IR_LABEL, label, -1, -1 });
+	return label;
+}
+
+static void writeJumpTo(OpCode op_code, int label) {
+	writeOpCode(op_code);
+	lastInstruction()->operand = label;
+}
+
+// Writes a jump to a new label, and returns the label.
+static int writeJump(OpCode op_code) {
+	int label = newLabel();
+	writeJumpTo(op_code, label);
+	return label;
+}
+
+static void writeValue(Value value) {
+	writeConstant(writeValueArray(&current_function->constants, value));
+}
+
+/*
+ * Constant folding.
+ * Operators whose operands are constants are evaluated as they are parsed, and their instructions
+ * are replaced by the load of the result. The compiler only folds what the VM would compute without
+ * error, so that runtime errors (e.g adding a number and a string) are still raised when the
+ * code runs.
+ * */
+
+static OperandStart operandStart() {
+	return (OperandStart) { current_code->count, current_function->constants.count };
+}
+
+// Returns whether the instructions in [start, end) only load a constant, and stores the constant in `value`.
+static bool isConstant(int start, int end, Value *value) {
+	if(end - start != 1 || current_code->array[start].op != OP_VALUE) return false;
+	*value = current_function->constants.array[current_code->array[start].operand];
+	return true;
+}
+
+// Whether the instructions in [start, end) only load `number` (0 and -0 are different numbers here).
+static bool isNumberConstant(int start, int end, double number) {
+	Value value;
+	return isConstant(start, end, &value) && IS_NUMBER(value) && AS_NUMBER(value) == number &&
+		signbit(AS_NUMBER(value)) == signbit(number);
+}
+
+// Removes the instructions and the constants written since `start`. The removed code pushed `values`
+// values on the stack.
+static void discardCode(OperandStart start, int values) {
+	current_code->count = start.code;
+	truncateValueArray(&current_function->constants, start.constant_count);
+	current_function->stack_depth -= values;
+}
+
+/*
+ * Writes the instruction of a binary operator whose operands were compiled from `left` and from
+ * `right`, folding it when both operands are constants.
+ * When one operand is known to be a number, the identities x * 1, 1 * x, x / 1 and x - 0 drop the
+ * operator and the constant. (x + 0 is kept: it turns -0 into 0.)
+ * Sets `known_number` for the result.
+ * */
+static void writeBinaryOperation(OpCode op_code, OperandStart left, OperandStart right,
+		bool left_number, bool right_number)
+{
+	int end = current_code->count;
+	known_number = op_code == OP_SUBSTRACT || op_code == OP_MULTIPLY || op_code == OP_DIVIDE ||
+		(op_code == OP_ADD && (left_number || right_number));
+	if(optimization_level < 1) {
+		writeOpCode(op_code);
+		return;
+	}
+
+	Value lhs, rhs, result;
+	if(isConstant(left.code, right.code, &lhs) && isConstant(right.code, end, &rhs) &&
+			foldBinaryOperation(op_code, lhs, rhs, &result))
+	{
+		discardCode(left, 2);
+		writeValue(result);
+		return;
+	}
+
+	if(left_number && (((op_code == OP_MULTIPLY || op_code == OP_DIVIDE) && isNumberConstant(right.code, end, 1)) ||
+			(op_code == OP_SUBSTRACT && isNumberConstant(right.code, end, 0))))
+	{
+		discardCode(right, 1);
+		return;
+	}
+	if(right_number && op_code == OP_MULTIPLY && isNumberConstant(left.code, right.code, 1)) {
+		// Move the instructions of `x` over the constant.
+		Instruction *code = current_code->array;
+		memmove(code + left.code, code + right.code, sizeof(Instruction) * (end - right.code));
+		current_code->count -= right.code - left.code;
+		current_function->stack_depth--;
+		return;
+	}
+
+	writeOpCode(op_code);
+}
+
+// Writes the instruction of a unary operator whose operand was compiled from `operand`, folding it
+// when the operand is a constant. Sets `known_number` for the result.
+static void writeUnaryOperation(OpCode op_code, OperandStart operand) {
+	known_number = op_code == OP_NEGATE;
+
+	Value value, result;
+	if(optimization_level >= 1 && isConstant(operand.code, current_code->count, &value) &&
+			foldUnaryOperation(op_code, value, &result))
+	{
+		discardCode(operand, 1);
+		writeValue(result);
+		return;
+	}
+	writeOpCode(op_code);
+}
+
+static bool identifierEquals(Token *identifier, const char *name) {
+	return strncmp(name, identifier->start, identifier->length) == 0 && name[identifier->length] == '\0';
+}
+
+// Returns the lexeme of `token` as a null terminated string, in a buffer that is reused
+// by the next call.
+static char *lexemeText(Token *token) {
+	static char *buffer = NULL;
+	static int capacity = 0;
+	if(token->length + 1 > capacity) {
+		capacity = token->length + 1 > 2 * capacity ? token->length + 1 : 2 * capacity;
+		buffer = realloc(buffer, capacity);
+		CHECK(buffer != NULL, "Failed to allocate memory");
+	}
+	memcpy(buffer, token->start, token->length);
+	buffer[token->length] = '\0';
+	return buffer;
 }
 
 /*
@@ -131,36 +392,40 @@ static void assignment() {
 		CHECK(false, "Invalid assignment target");
 	}
 
-	char *lexeme = parser.previous->lexeme;
+	Token identifier = parser.previous;
 	if(can_assign && matchAndEatToken(TOKEN_EQUAL)) {
 		assignment();
 
-		int reso = resolveLocal(lexeme);
+		int reso = resolveVariable(&identifier);
 		OpCode set_op;
 		if(reso < 0) {
 			reso = -reso - 1;
-			set_op = OP_ASSIGN_GLOBAL;
+			set_op = OP_SET_GLOBAL;
 		}
 		else {
-			set_op = OP_ASSIGN;
+			set_op = OP_SET_LOCAL;
 		}
-		writeByteArray(&current_function->code, set_op);
-		WRITE_VALUE(CREATE_NUMBER, reso);
+		writeOpCode(set_op);
+		writeShortOperand(reso);
+		if(set_op == OP_SET_LOCAL) lastInstruction()->variable = current_function->locals[reso].variable;
 	}
 }
 
 static bool or() {
 	bool can_assign = and();
 
+	// The left operand is the value of the expression when it decides it, so the jump leaves it on
+	// the stack and the right operand replaces it otherwise.
 	if(matchAndEatToken(TOKEN_OR)) {
 		can_assign = false;
+		known_number = false;
 
-		int next_operand_jump = setCheckPoint(OP_JUMP_IF_FALSE);
-		int exit_jump = setCheckPoint(OP_JUMP);
-		setJumpSize(next_operand_jump);
+		int exit_jump = writeJump(OP_JUMP_IF_TRUE_NO_POP);
+		writeOpCode(OP_POP);
 		assignment();
+		known_number = false;
 
-		setJumpSize(exit_jump);
+		placeLabel(exit_jump);
 	}
 	return can_assign;
 
@@ -171,91 +436,106 @@ static bool and() {
 
 	if(matchAndEatToken(TOKEN_AND)) {
 		can_assign = false;
-		int exit_jump = setCheckPoint(OP_JUMP_IF_FALSE);
+		int exit_jump = writeJump(OP_JUMP_IF_FALSE_NO_POP);
+		writeOpCode(OP_POP);
 		assignment();
-		setJumpSize(exit_jump);
+		known_number = false;
+		placeLabel(exit_jump);
 	}
 
 	return can_assign;
 }
 
 static bool equality() {
+	OperandStart left = operandStart();
 	bool can_assign = comparison();
 	while(matchAndEatToken(TOKEN_EQUAL_EQUAL) || matchAndEatToken(TOKEN_BANG_EQUAL)) {
 		can_assign = false;
 
-		char *operator = parser.previous->lexeme;
+		TokenType operator = parser.previous.type;
+		bool left_number = known_number;
+		OperandStart right = operandStart();
 		comparison();
 
 		// Actions associated with the production `equality`
-		if(stringEquals(operator, "==")) writeByteArray(&current_function->code, OP_EQUAL_EQUAL);
-		if(stringEquals(operator, "!=")) writeByteArray(&current_function->code, OP_BANG_EQUAL);
+		OpCode op_code = operator == TOKEN_EQUAL_EQUAL ? OP_EQUAL_EQUAL : OP_BANG_EQUAL;
+		writeBinaryOperation(op_code, left, right, left_number, known_number);
 	}
 	return can_assign;
 }
 
 static bool comparison() {
+	OperandStart left = operandStart();
 	bool can_assign = term();
 	while(matchAndEatToken(TOKEN_LESS_EQUAL) || matchAndEatToken(TOKEN_LESS) || 
 			matchAndEatToken(TOKEN_GREATER) || matchAndEatToken(TOKEN_GREATER_EQUAL))
 	{
 		can_assign = false;
 
-		char *operator = parser.previous->lexeme;
+		TokenType operator = parser.previous.type;
+		bool left_number = known_number;
+		OperandStart right = operandStart();
 		term();
 
 		// Actions associated with the production `comparison`
-		if(stringEquals(operator, ">=")) writeByteArray(&current_function->code, OP_GREATER_EQUAL);
-		if(stringEquals(operator, "<=")) writeByteArray(&current_function->code, OP_LESS_EQUAL);
-		if(stringEquals(operator, ">")) writeByteArray(&current_function->code, OP_GREATER);
-		if(stringEquals(operator, "<")) writeByteArray(&current_function->code, OP_LESS);
+		OpCode op_code = OP_LESS;
+		if(operator == TOKEN_GREATER_EQUAL) op_code = OP_GREATER_EQUAL;
+		if(operator == TOKEN_LESS_EQUAL) op_code = OP_LESS_EQUAL;
+		if(operator == TOKEN_GREATER) op_code = OP_GREATER;
+		writeBinaryOperation(op_code, left, right, left_number, known_number);
 	}
 	return can_assign;
 }
 
 static bool term() {
+	OperandStart left = operandStart();
 	bool can_assign = factor();
 	while(matchAndEatToken(TOKEN_PLUS) || matchAndEatToken(TOKEN_MINUS)) {
 		can_assign = false;
 
-		char *operator = parser.previous->lexeme;
+		TokenType operator = parser.previous.type;
+		bool left_number = known_number;
+		OperandStart right = operandStart();
 		factor();
 
 		// Actions associated with the production `term`
-		if(stringEquals(operator, "+")) writeByteArray(&current_function->code, OP_ADD);
-		if(stringEquals(operator, "-")) writeByteArray(&current_function->code, OP_SUBSTRACT);
+		OpCode op_code = operator == TOKEN_PLUS ? OP_ADD : OP_SUBSTRACT;
+		writeBinaryOperation(op_code, left, right, left_number, known_number);
 	}
 	return can_assign;
 }
 
 static bool factor() {
+	OperandStart left = operandStart();
 	bool can_assign = unary();
 	while(matchAndEatToken(TOKEN_STAR) || matchAndEatToken(TOKEN_SLASH)) {
 		can_assign = false;
 
-		char *operator = parser.previous->lexeme;
+		TokenType operator = parser.previous.type;
+		bool left_number = known_number;
+		OperandStart right = operandStart();
 		unary();
 
 		// Actions associated with the production `factor`
-		if(stringEquals(operator, "*")) writeByteArray(&current_function->code, OP_MULTIPLY);
-		if(stringEquals(operator, "/")) writeByteArray(&current_function->code, OP_DIVIDE);
+		OpCode op_code = operator == TOKEN_STAR ? OP_MULTIPLY : OP_DIVIDE;
+		writeBinaryOperation(op_code, left, right, left_number, known_number);
 	}
 	return can_assign;
 }
 
 static bool unary() {
-	bool can_assign = true;
-	while(matchAndEatToken(TOKEN_BANG) || matchAndEatToken(TOKEN_MINUS)) {
-		can_assign = false;
-
-		char *operator = parser.previous->lexeme;
+	// The operand of a unary operator is itself a unary expression, so there is no loop here:
+	// the '-' that follows `-a` is a binary operator (`-a - b`).
+	if(matchAndEatToken(TOKEN_BANG) || matchAndEatToken(TOKEN_MINUS)) {
+		TokenType operator = parser.previous.type;
+		OperandStart operand = operandStart();
 		unary();
 
 		// Actions associated with the production `unary`
-		if(stringEquals(operator, "!")) writeByteArray(&current_function->code, OP_NOT);
-		if(stringEquals(operator, "-")) writeByteArray(&current_function->code, OP_NEGATE);
+		writeUnaryOperation(operator == TOKEN_BANG ? OP_NOT : OP_NEGATE, operand);
+		return false;
 	}
-	return can_assign && call();
+	return call();
 }
 
 static bool call() {
@@ -270,38 +550,62 @@ static bool call() {
 	} while(matchAndEatToken(TOKEN_COMMA));
 
 	eatTokenOrReturnError(TOKEN_RIGHT_PAREN, "Expected ')' after the end of the call");
-	writeByteArray(&current_function->code, OP_CALL);
-	WRITE_VALUE(CREATE_NUMBER, arity);
+	CHECK(arity <= UINT8_MAX, "Can't have more than 255 arguments");
+	writeOpCode(OP_CALL);
+	lastInstruction()->operand = arity;
+	updateStackDepth(-arity);
+	known_number = false;
 
 	return false;
 }
 
-static char *dynamicStrCpy(char *s) {
-	// Account for the terminating byte by allocating `strlen(s) + 1` bytes
-	// instead of `strlen(s)`.
-	char *ret = malloc(strlen(s) + 1);
-	CHECK(ret != NULL, "Failed to allocate memory");
+static char *copyLexeme(Token *token) {
+	// Account for the terminating byte by allocating `length + 1` bytes.
+	char *ret = allocateArena(&compile_arena, token->length + 1);
 
-	strcpy(ret, s);
+	memcpy(ret, token->start, token->length);
+	ret[token->length] = '\0';
 	return ret;
 }
 
-static int resolveLocal(char *lexeme) {
-	for(int i = current_function->local_top - 1; i >= 0 && current_function != global_function; --i) {
-		if(strcmp(lexeme, current_function->locals[i].name)) continue;
+// Returns the slot of `name` in `vm.globals`, giving it a new slot the first time the name is seen.
+static int globalSlot(Token *identifier) {
+	char *name = lexemeText(identifier);
+	Entry *entry = keyExists(&vm.table, name);
+	if(entry) return (int) AS_NUMBER(entry->value);
+
+	int slot = addGlobal();
+	CHECK(slot <= UINT16_MAX, "Too many global variables");
+	Entry new_entry = { .key = name, .value = CREATE_NUMBER(slot) };
+	insertHashTable(&vm.table, new_entry);
+	writeByteArray(&defined_globals, false);
+	return slot;
+}
+
+static bool isGlobalScope() {
+	return current_function == global_function && vm.scope == 0;
+}
+
+// Returns the slot of a local variable, or `-slot - 1` for a global variable.
+// Functions may use globals that are declared after them (they are checked at the end of `parse()`),
+// while the script itself runs in order and can only use globals that are already declared.
+static int resolveVariable(Token *identifier) {
+	for(int i = current_function->local_top - 1; i >= 0; --i) {
+		if(!identifierEquals(identifier, current_function->locals[i].name)) continue;
 		return i;
 	}
 
-	for(int i = 0; i < global_function->local_top; ++i) {
-		if(strcmp(lexeme, global_function->locals[i].name)) continue;
-		return -i - 1;
+	int slot = globalSlot(identifier);
+	if(current_function == global_function && !defined_globals.array[slot]) {
+		printf("%.*s\n", identifier->length, identifier->start);
+		CHECK(false, "undefined variable");
 	}
-	printf("%s\n", lexeme);
-	CHECK(false, "undefined variable");
+	return -slot - 1;
 }
 
 static bool primary() {
 	if(reachedEOF()) return false;
+	known_number = false;
 
 	// Actions associated with the terminal tokens.
 	if(matchAndEatToken(TOKEN_LEFT_PAREN)) {
@@ -309,24 +613,20 @@ static bool primary() {
 		eatTokenOrReturnError(TOKEN_RIGHT_PAREN, "Expected ')' after the end of the expression");
 		return false;
 	}
-	// We currently can't handle more than 255 values in our program because we only use one byte
-	// to encode the position of our value in the value_array of the virtual machine.
-	// This is why the variable `pos_on_value_array` is of type uint8_t.
 	else if(matchAndEatToken(TOKEN_NUMBER)) {
-		double number = strtod(parser.previous->lexeme, /*endPtr = */ NULL);
+		double number = strtod(lexemeText(&parser.previous), /*endPtr = */ NULL);
 		WRITE_VALUE(CREATE_NUMBER, number);
+		known_number = true;
 		return false;
 	}
 	else if(matchAndEatToken(TOKEN_TRUE) || matchAndEatToken(TOKEN_FALSE)) {
-		bool boolean = stringEquals(parser.previous->lexeme, "true");
+		bool boolean = parser.previous.type == TOKEN_TRUE;
 		WRITE_VALUE(CREATE_BOOLEAN, boolean);
 		return false;
 	}
 	else if(matchAndEatToken(TOKEN_STRING)) {
-		// Create a string Value from a copy of the lexeme.
-		// We copy the lexeme because our string_value will outlive the lexeme owned by Token.
-		char *copy_lexeme = dynamicStrCpy(parser.previous->lexeme);
-		WRITE_VALUE(CREATE_STRING, copy_lexeme);
+		// Create a string Value from an interned copy of the lexeme, which is a view into the source.
+		WRITE_VALUE(CREATE_STRING, copyString(parser.previous.start, parser.previous.length));
 		return false;
 	}
 	else if(matchAndEatToken(TOKEN_NIL)) {
@@ -338,11 +638,11 @@ static bool primary() {
 
 		// Check for reflexive assignment
 		for(int i = current_function->local_top - 1; i >= 0; --i) {
-			if(strcmp(parser.previous->lexeme, current_function->locals[i].name)) continue;
+			if(!identifierEquals(&parser.previous, current_function->locals[i].name)) continue;
 			CHECK(current_function->locals[i].scope != -1, "Relfexive assignment is not allowed");
 		}
 
-		int reso = resolveLocal(parser.previous->lexeme);
+		int reso = resolveVariable(&parser.previous);
 		OpCode get_op;
 		// Global variable
 		if(reso < 0) {
@@ -350,26 +650,57 @@ static bool primary() {
 			get_op = OP_GET_GLOBAL;
 		}
 		else {
-			get_op = OP_GET;
+			get_op = OP_GET_LOCAL;
 		}
-		writeByteArray(&current_function->code, get_op);
-		WRITE_VALUE(CREATE_NUMBER, reso);
+		writeOpCode(get_op);
+		writeShortOperand(reso);
+		if(get_op == OP_GET_LOCAL) lastInstruction()->variable = current_function->locals[reso].variable;
 		return true;
 	}
 	else {
 		// Expected an expression but found something else. We return an error.
-		printf("%s\n", tokenizer.token_array.array[parser.current].lexeme);
+		printf("%.*s\n", parser.current.length, parser.current.start);
 		CHECK(/*condition = */false, "Unexpected token");
 		return false;
 	}
 }
 
+// Optimizes the instructions of `function`, which is the current function, and writes its bytecode.
+static void finishFunction(Function *function) {
+	optimizeInstructions(current_code, &function->constants, optimization_level);
+	lowerInstructions(current_code, function);
+	freeInstructionArray(current_code);
+}
+
 void parse() {
 	global_function = createFunction("__main__");
 	current_function = global_function;
+	InstructionArray code;
+	initInstructionArray(&code);
+	current_code = &code;
+	initByteArray(&defined_globals);
+	initArena(&compile_arena);
+	parser.current = scanToken();
 	while(!reachedEOF()) {
 		declaration();
 	}
+
+	// Every global used by a function must be declared somewhere in the script.
+	// (Names are never deleted from `vm.table`, so every entry with a key is used.)
+	for(int i = 0; i < vm.table.capacity; ++i) {
+		Entry *entry = &vm.table.entries[i];
+		if(entry->key == NULL || defined_globals.array[(int) AS_NUMBER(entry->value)]) continue;
+		printf("%s\n", entry->key);
+		CHECK(false, "undefined variable");
+	}
+	freeByteArray(&defined_globals);
+	freeArena(&compile_arena);
+	// The script returns like any other function so that the VM never has to check
+	// for the end of the bytecode.
+	WRITE_VALUE(CREATE_NIL);
+	writeOpCode(OP_RETURN);
+	finishFunction(global_function);
+	current_code = NULL;
 }
 
 static void declaration() {
@@ -384,18 +715,40 @@ static void declaration() {
 	}
 }
 
+static void globalVarDeclaration() {
+	int slot = globalSlot(&parser.previous);
+	CHECK(!defined_globals.array[slot], "Variable already defined");
+
+	if(matchAndEatToken(TOKEN_EQUAL)) {
+		expression();
+	}
+	else {
+		WRITE_VALUE(CREATE_NIL);
+	}
+	// The variable can only be used once its initializer is compiled.
+	defined_globals.array[slot] = true;
+	writeOpCode(OP_DEFINE_GLOBAL);
+	writeShortOperand(slot);
+
+	eatTokenOrReturnError(TOKEN_SEMICOLON, "Expected ';' after var declaration");
+}
+
 static void varDeclaration() {
 	eatTokenOrReturnError(TOKEN_IDENTIFIER, "Expected Identifier after 'var'.");
+	if(isGlobalScope()) {
+		globalVarDeclaration();
+		return;
+	}
 
 	// Check if a variable was already defined before.
 
 	for(int i = current_function->local_top - 1; i >= 0 &&
 			current_function->locals[i].scope == vm.scope; --i) {
-		if(strcmp(current_function->locals[i].name, parser.previous->lexeme)) continue;
+		if(!identifierEquals(&parser.previous, current_function->locals[i].name)) continue;
 		CHECK(false, "Variable already defined");
 	}
 
-	defineVariable(parser.previous->lexeme);
+	defineVariable(&parser.previous);
 
 	if(matchAndEatToken(TOKEN_EQUAL)) {
 		expression();
@@ -405,33 +758,61 @@ static void varDeclaration() {
 	}
 	// Mark as initialized
 	initializeVariable();
+	writeDefineLocal();
 
 	eatTokenOrReturnError(TOKEN_SEMICOLON, "Expected ';' after var declaration");
 }
 
-static void defineVariable(char *lexeme) {
-	char *name = dynamicStrCpy(lexeme);
+static void defineVariable(Token *identifier) {
+	char *name = copyLexeme(identifier);
+	if(current_function->local_top + 1 > current_function->local_capacity) {
+		current_function->local_capacity = current_function->local_capacity > 0 ?
+			2 * current_function->local_capacity : 8;
+		current_function->locals = realloc(current_function->locals,
+				sizeof(Local) * current_function->local_capacity);
+		CHECK(current_function->locals != NULL, "Failed to allocate memory");
+	}
 	Local *local = &current_function->locals[current_function->local_top++];
 	local->name = name;
 	local->scope = -1;
+	local->variable = current_code->variable_count++;
 }
 
 static void initializeVariable() {
 	current_function->locals[current_function->local_top - 1].scope = vm.scope;
 }
 
+// The value on top of the stack is the initial value of the last declared local variable.
+static void writeDefineLocal() {
+	int variable = current_function->locals[current_function->local_top - 1].variable;
+	writeInstructionArray(current_code, (Instruction) { IR_DEFINE_LOCAL, 0, variable, -1 });
+}
+
 static void funDeclaration() {
 	// function name
-	char *function_name = eatTokenOrReturnError(TOKEN_IDENTIFIER, 
-			"Expected identifier after fun clause")->lexeme;
+	Token function_name = *eatTokenOrReturnError(TOKEN_IDENTIFIER,
+			"Expected identifier after fun clause");
 
-	Function *new_function = createFunction(function_name);
+	Function *new_function = createFunction(lexemeText(&function_name));
 	Function *previous_function = current_function;
 
-	defineVariable(function_name);
-	initializeVariable();
+	// The function is declared before its body so that it can call itself.
+	int global_slot = -1;
+	if(isGlobalScope()) {
+		global_slot = globalSlot(&function_name);
+		defined_globals.array[global_slot] = true;
+	}
+	else {
+		defineVariable(&function_name);
+		initializeVariable();
+	}
 
 	current_function = new_function;
+	InstructionArray *previous_code = current_code;
+	InstructionArray code;
+	initInstructionArray(&code);
+	current_code = &code;
+	ArenaMark parameters_mark = markArena(&compile_arena);
 
 	// Open parenthesis
 	eatTokenOrReturnError(TOKEN_LEFT_PAREN, "Expected '(' after function name");
@@ -440,11 +821,13 @@ static void funDeclaration() {
 	do {
 		if(peekToken()->type == TOKEN_RIGHT_PAREN) break;
 
-		char *param_name = eatTokenOrReturnError(TOKEN_IDENTIFIER, 
-				"Expected identifier name")->lexeme;
+		Token *param_name = eatTokenOrReturnError(TOKEN_IDENTIFIER,
+				"Expected identifier name");
 		defineVariable(param_name);
 		initializeVariable();
 		current_function->arity++;
+		// Arguments are already on the stack when the function starts executing.
+		updateStackDepth(1);
 
 	}	while(matchAndEatToken(TOKEN_COMMA));
 
@@ -454,58 +837,47 @@ static void funDeclaration() {
 	// Function body.
 	block();
 	WRITE_VALUE(CREATE_NIL);
-	writeByteArray(&current_function->code, OP_RETURN);
-
+	writeOpCode(OP_RETURN);
+	finishFunction(new_function);
 
 	// Go back to the outer function once we are done parsing the inner one.
+	// The names of its parameters are not needed anymore.
+	releaseArena(&compile_arena, parameters_mark);
 	current_function = previous_function;
+	current_code = previous_code;
 
 	WRITE_VALUE(CREATE_FUNCTION, new_function);
+	if(global_slot >= 0) {
+		writeOpCode(OP_DEFINE_GLOBAL);
+		writeShortOperand(global_slot);
+	}
+	else {
+		writeDefineLocal();
+	}
 }
 
 static void expressionStatement() {
 	expression();
-	writeByteArray(&current_function->code, OP_POP);
+	writeOpCode(OP_POP);
 	eatTokenOrReturnError(TOKEN_SEMICOLON, "Expected ';' at the end of the expression");
 }
 
-static int setCheckPoint(OpCode op_code) {
-	writeByteArray(&current_function->code, op_code);
-	writeByteArray(&current_function->code, 0xff);
-	writeByteArray(&current_function->code, 0xff);
-
-	return current_function->code.count - 3;
-}
-
-static void setJumpSize(int jump) {
-	int correct_jump_size = current_function->code.count - jump;
-
-	current_function->code.array[jump + 1] = (correct_jump_size >> 8) & 0xff;
-	current_function->code.array[jump + 2] = correct_jump_size & 0xff;
-}
-
-static void setBackWardJumpSize(int jump, int loop_start) {
-	int correct_jump_size = current_function->code.count - loop_start - 3;
-
-	current_function->code.array[jump + 1] = (correct_jump_size >> 8) & 0xff;
-	current_function->code.array[jump + 2] = correct_jump_size & 0xff;
-}
-
+// Branches whose condition is constant are removed by the optimization passes (see ir.h).
 static void ifStatement() {
 	eatTokenOrReturnError(TOKEN_LEFT_PAREN, "Expected '(' after 'if'");
 	expression();
 	eatTokenOrReturnError(TOKEN_RIGHT_PAREN, "Expected ')' after if expression");
 
-	int jump_then = setCheckPoint(OP_JUMP_IF_FALSE);
+	int jump_then = writeJump(OP_JUMP_IF_FALSE);
 	statement();
-	int jump_else = setCheckPoint(OP_JUMP);
+	int jump_else = writeJump(OP_JUMP);
 
-	setJumpSize(jump_then);
+	placeLabel(jump_then);
 
 	if(matchAndEatToken(TOKEN_ELSE)) {
 		statement();
 	}
-	setJumpSize(jump_else);
+	placeLabel(jump_else);
 
 }
 
@@ -513,37 +885,52 @@ static void deleteOutOfScopeVariables() {
 	while(current_function->local_top > 0 && 
 			current_function->locals[current_function->local_top - 1].scope > vm.scope)
 	{
-		writeByteArray(&current_function->code, OP_POP);
+		writeOpCode(OP_POP);
 		current_function->local_top--;
-		free(current_function->locals[current_function->local_top].name);
 	}
 }
 
 static void block() {
+	ArenaMark scope_mark = markArena(&compile_arena);
 	vm.scope++;
 	while(!reachedEOF() && !(peekToken()->type == TOKEN_RIGHT_BRACE)) {
 		declaration();
 	}
 	vm.scope--;
 	deleteOutOfScopeVariables();
+	releaseArena(&compile_arena, scope_mark);
 	eatTokenOrReturnError(TOKEN_RIGHT_BRACE, "Expected '}' after the block");
 }
 
+/*
+ * Loops test their condition after their body, so that an iteration only pays for one conditional
+ * jump back to the body:
+ *         OP_JUMP condition
+ *   body: body
+ *         increment (for loops), OP_POP
+ *   condition: condition
+ *         OP_JUMP_BACKWARD_IF_TRUE body
+ * The parts are parsed in the order of the source and moved to their place in the instructions.
+ * The stack depth counts the value of the condition during the body, which only overestimates it.
+ * */
 static void whileStatement() {
 	eatTokenOrReturnError(TOKEN_LEFT_PAREN, "Expected '(' after 'while'");
-	int loop_start = current_function->code.count;
+	int condition = writeJump(OP_JUMP);
+	int condition_start = current_code->count;
+	placeLabel(condition);
 	expression();
+	int condition_end = current_code->count;
 	eatTokenOrReturnError(TOKEN_RIGHT_PAREN, "Expected ')' after while expression");
 
-	int exit_jump = setCheckPoint(OP_JUMP_IF_FALSE);
+	int body = placeLabel(newLabel());
 	statement();
-	int go_back = setCheckPoint(OP_JUMP_BACKWARD);
 
-	setJumpSize(exit_jump);
-	setBackWardJumpSize(go_back, loop_start);
+	moveInstructionsToEnd(current_code, condition_start, condition_end);
+	writeJumpTo(OP_JUMP_BACKWARD_IF_TRUE, body);
 }
 
 static void forStatement() {
+	ArenaMark scope_mark = markArena(&compile_arena);
 	vm.scope++;
 	eatTokenOrReturnError(TOKEN_LEFT_PAREN, "Expected '(' after for statement");
 
@@ -558,38 +945,36 @@ static void forStatement() {
 		expressionStatement();
 	}
 
-	int condition_index = current_function->code.count;
+	int condition = writeJump(OP_JUMP);
+	int condition_start = current_code->count;
+	placeLabel(condition);
 	// Condition
 	expression();
+	int condition_end = current_code->count;
 	eatTokenOrReturnError(TOKEN_SEMICOLON, "Expected ';' after the condition expression");
 
-	int jump_out_body = setCheckPoint(OP_JUMP_IF_FALSE);
-	int jump_to_body = setCheckPoint(OP_JUMP);
-
-	int increment_index = current_function->code.count;
 	// increment
 	expression();
-	writeByteArray(&current_function->code, OP_POP);
+	writeOpCode(OP_POP);
+	int increment_end = current_code->count;
 	eatTokenOrReturnError(TOKEN_RIGHT_PAREN, "Expected ')' after the end of the for loop");
 
-	int check_condition_idx = setCheckPoint(OP_JUMP_BACKWARD);
-	setBackWardJumpSize(check_condition_idx, condition_index);
-
-	setJumpSize(jump_to_body);
+	int body = placeLabel(newLabel());
 	// for loop body
 	statement();
 
-	int go_back_to_idx = setCheckPoint(OP_JUMP_BACKWARD);
-	setBackWardJumpSize(go_back_to_idx, increment_index);
+	moveInstructionsToEnd(current_code, condition_end, increment_end);
+	moveInstructionsToEnd(current_code, condition_start, condition_end);
+	writeJumpTo(OP_JUMP_BACKWARD_IF_TRUE, body);
 
 	vm.scope--;
-	setJumpSize(jump_out_body);
 	deleteOutOfScopeVariables();
+	releaseArena(&compile_arena, scope_mark);
 }
 
 static void printStatement() {
 	expression();
-	writeByteArray(&current_function->code, OP_PRINT);
+	writeOpCode(OP_PRINT);
 	eatTokenOrReturnError(TOKEN_SEMICOLON, "Expected ';' after the end of a print statement");
 }
 
@@ -601,7 +986,7 @@ static void returnStatement() {
 		expression();
 		eatTokenOrReturnError(TOKEN_SEMICOLON, "Expected ';' after expression");
 	}
-	writeByteArray(&current_function->code, OP_RETURN);
+	writeOpCode(OP_RETURN);
 }
 
 static void statement() {
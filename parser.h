@@ -3,28 +3,30 @@
 
 #include "tokenizer.h"
 
+/*
+ * Adds a value to the constant pool of the function being compiled and writes the instruction
+ * that pushes it onto the stack.
+ * */
 #define WRITE_VALUE(value_type, ...) \
 		do { \
-				writeByteArray(&current_function->code, OP_VALUE); \
-				uint8_t pos_on_value_array = writeValueArray(&vm.value_array, value_type(__VA_ARGS__)); \
-				writeByteArray(&current_function->code, pos_on_value_array); \
+				int pos_on_value_array = writeValueArray(&current_function->constants, value_type(__VA_ARGS__)); \
+				writeConstant(pos_on_value_array); \
 		}while(false)
 
 
 /*
  * The parser holds:
- *   + a reference to the most recent token parsed
- *   + an index pointing at where we are in the global array of tokens.
- * The parser does not own the memory of [Token *previous]. Tokenizer will be responsible for
- * freeing it.
+ *   + the most recent token parsed
+ *   + the token that is about to be parsed, which is scanned from the source on demand.
+ * The lexemes of the tokens are views into the source file owned by the tokenizer.
  * There will be one global instance of the struct Parser throughout the whole parsing operation.
  * */
 
 typedef struct Parser Parser;
 
 struct Parser {
-		Token *previous;
-		int current;
+		Token previous;
+		Token current;
 };
 void initParser(Parser *parser);
 void freeParser(Parser *parser);
@@ -35,6 +37,11 @@ void freeParser(Parser *parser);
  * */
 void parse();
 
+/*
+ * Sets the optimization level of the compiler (see ir.h), e.g from the -O option of the command line.
+ * */
+void setOptimizationLevel(int level);
+
 extern Parser parser;
 
 #endif
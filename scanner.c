@@ -0,0 +1,207 @@
+#include "scanner.h"
+#include <stdint.h>
+
+static const char *scalarSkipWhiteSpace(const char *current, const char *end, int *line) {
+		while(current < end && isWhiteSpaceChar(*current)) {
+				*line += *current == '\n';
+				current++;
+		}
+		return current;
+}
+
+static const char *scalarSkipIdentifier(const char *current, const char *end) {
+		while(current < end && isIdentifierChar(*current)) current++;
+		return current;
+}
+
+static const char *scalarSkipDigits(const char *current, const char *end) {
+		while(current < end && isDigitChar(*current)) current++;
+		return current;
+}
+
+static const char *scalarSkipStringContents(const char *current, const char *end, int *line) {
+		while(current < end && *current != '"') {
+				*line += *current == '\n';
+				current++;
+		}
+		return current;
+}
+
+const Scanners scalar_scanners = {
+		.name = "scalar",
+		.skipWhiteSpace = scalarSkipWhiteSpace,
+		.skipIdentifier = scalarSkipIdentifier,
+		.skipDigits = scalarSkipDigits,
+		.skipStringContents = scalarSkipStringContents
+};
+
+#ifdef SCANNER_X86
+#include <immintrin.h>
+
+/*
+ * The vector scanners compute a bit mask with one bit per character of the block (from movemask),
+ * set for the characters that end the run. The run ends at the lowest set bit, if any. Otherwise the
+ * whole block belongs to the run and the scan goes on with the next block. The last bytes, which do
+ * not fill a block, are left to the scalar scanners so that no load reads past `end`.
+ *
+ * Comparisons on bytes are signed: characters >= 0x80 are negative and never fall in an ASCII range.
+ * */
+
+// Number of newlines among the `count` first characters described by `newlines`.
+static inline int countNewLines(uint32_t newlines, int count) {
+		return __builtin_popcount(count < 32 ? newlines & ((1u << count) - 1) : newlines);
+}
+
+// SSE2 is part of x86-64, but not of every 32-bit x86 CPU.
+#define SSE2_FUNCTION __attribute__((target("sse2")))
+
+SSE2_FUNCTION static inline __m128i inRange128(__m128i chunk, char low, char high) {
+		return _mm_and_si128(_mm_cmpgt_epi8(chunk, _mm_set1_epi8(low - 1)),
+						_mm_cmplt_epi8(chunk, _mm_set1_epi8(high + 1)));
+}
+
+SSE2_FUNCTION static const char *sse2SkipWhiteSpace(const char *current, const char *end, int *line) {
+		while(end - current >= 16) {
+				__m128i chunk = _mm_loadu_si128((const __m128i *) current);
+				__m128i space = _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')), inRange128(chunk, '\t', '\r'));
+				uint32_t stop = ~_mm_movemask_epi8(space) & 0xffff;
+				uint32_t newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')));
+				if(stop) {
+						int length = __builtin_ctz(stop);
+						*line += countNewLines(newlines, length);
+						return current + length;
+				}
+				*line += __builtin_popcount(newlines);
+				current += 16;
+		}
+		return scalarSkipWhiteSpace(current, end, line);
+}
+
+SSE2_FUNCTION static const char *sse2SkipIdentifier(const char *current, const char *end) {
+		while(end - current >= 16) {
+				__m128i chunk = _mm_loadu_si128((const __m128i *) current);
+				// Setting the bit 0x20 maps the upper case letters to the lower case ones.
+				__m128i letter = inRange128(_mm_or_si128(chunk, _mm_set1_epi8(0x20)), 'a', 'z');
+				__m128i other = _mm_or_si128(inRange128(chunk, '0', '9'), _mm_cmpeq_epi8(chunk, _mm_set1_epi8('_')));
+				uint32_t stop = ~_mm_movemask_epi8(_mm_or_si128(letter, other)) & 0xffff;
+				if(stop) return current + __builtin_ctz(stop);
+				current += 16;
+		}
+		return scalarSkipIdentifier(current, end);
+}
+
+SSE2_FUNCTION static const char *sse2SkipDigits(const char *current, const char *end) {
+		while(end - current >= 16) {
+				__m128i chunk = _mm_loadu_si128((const __m128i *) current);
+				uint32_t stop = ~_mm_movemask_epi8(inRange128(chunk, '0', '9')) & 0xffff;
+				if(stop) return current + __builtin_ctz(stop);
+				current += 16;
+		}
+		return scalarSkipDigits(current, end);
+}
+
+SSE2_FUNCTION static const char *sse2SkipStringContents(const char *current, const char *end, int *line) {
+		while(end - current >= 16) {
+				__m128i chunk = _mm_loadu_si128((const __m128i *) current);
+				uint32_t stop = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('"')));
+				uint32_t newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')));
+				if(stop) {
+						int length = __builtin_ctz(stop);
+						*line += countNewLines(newlines, length);
+						return current + length;
+				}
+				*line += __builtin_popcount(newlines);
+				current += 16;
+		}
+		return scalarSkipStringContents(current, end, line);
+}
+
+const Scanners sse2_scanners = {
+		.name = "sse2",
+		.skipWhiteSpace = sse2SkipWhiteSpace,
+		.skipIdentifier = sse2SkipIdentifier,
+		.skipDigits = sse2SkipDigits,
+		.skipStringContents = sse2SkipStringContents
+};
+
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+
+AVX2_FUNCTION static inline __m256i inRange256(__m256i chunk, char low, char high) {
+		return _mm256_and_si256(_mm256_cmpgt_epi8(chunk, _mm256_set1_epi8(low - 1)),
+						_mm256_cmpgt_epi8(_mm256_set1_epi8(high + 1), chunk));
+}
+
+AVX2_FUNCTION static const char *avx2SkipWhiteSpace(const char *current, const char *end, int *line) {
+		while(end - current >= 32) {
+				__m256i chunk = _mm256_loadu_si256((const __m256i *) current);
+				__m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(' ')),
+								inRange256(chunk, '\t', '\r'));
+				uint32_t stop = ~(uint32_t) _mm256_movemask_epi8(space);
+				uint32_t newlines = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\n')));
+				if(stop) {
+						int length = __builtin_ctz(stop);
+						*line += countNewLines(newlines, length);
+						return current + length;
+				}
+				*line += __builtin_popcount(newlines);
+				current += 32;
+		}
+		return sse2SkipWhiteSpace(current, end, line);
+}
+
+AVX2_FUNCTION static const char *avx2SkipIdentifier(const char *current, const char *end) {
+		while(end - current >= 32) {
+				__m256i chunk = _mm256_loadu_si256((const __m256i *) current);
+				__m256i letter = inRange256(_mm256_or_si256(chunk, _mm256_set1_epi8(0x20)), 'a', 'z');
+				__m256i other = _mm256_or_si256(inRange256(chunk, '0', '9'),
+								_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('_')));
+				uint32_t stop = ~(uint32_t) _mm256_movemask_epi8(_mm256_or_si256(letter, other));
+				if(stop) return current + __builtin_ctz(stop);
+				current += 32;
+		}
+		return sse2SkipIdentifier(current, end);
+}
+
+AVX2_FUNCTION static const char *avx2SkipDigits(const char *current, const char *end) {
+		while(end - current >= 32) {
+				__m256i chunk = _mm256_loadu_si256((const __m256i *) current);
+				uint32_t stop = ~(uint32_t) _mm256_movemask_epi8(inRange256(chunk, '0', '9'));
+				if(stop) return current + __builtin_ctz(stop);
+				current += 32;
+		}
+		return sse2SkipDigits(current, end);
+}
+
+AVX2_FUNCTION static const char *avx2SkipStringContents(const char *current, const char *end, int *line) {
+		while(end - current >= 32) {
+				__m256i chunk = _mm256_loadu_si256((const __m256i *) current);
+				uint32_t stop = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('"')));
+				uint32_t newlines = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, _mm256_set1_epi8('\n')));
+				if(stop) {
+						int length = __builtin_ctz(stop);
+						*line += countNewLines(newlines, length);
+						return current + length;
+				}
+				*line += __builtin_popcount(newlines);
+				current += 32;
+		}
+		return sse2SkipStringContents(current, end, line);
+}
+
+const Scanners avx2_scanners = {
+		.name = "avx2",
+		.skipWhiteSpace = avx2SkipWhiteSpace,
+		.skipIdentifier = avx2SkipIdentifier,
+		.skipDigits = avx2SkipDigits,
+		.skipStringContents = avx2SkipStringContents
+};
+#endif
+
+const Scanners *selectScanners() {
+#if defined(SCANNER_X86) && !defined(SCANNER_SCALAR)
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2")) return &avx2_scanners;
+		if(__builtin_cpu_supports("sse2")) return &sse2_scanners;
+#endif
+		return &scalar_scanners;
+}
@@ -0,0 +1,51 @@
+#ifndef COMPILER_SCANNER_H
+#define COMPILER_SCANNER_H
+
+#include <stdbool.h>
+
+/*
+ * Character class scanners used by the tokenizer to find the end of a run of characters.
+ * Each scanner starts at `current` and returns a pointer to the first character of `[current, end)`
+ * that is not part of the run (or `end`). The scanners that can cross a line add the number of
+ * newlines they went past to `*line`.
+ *
+ * There is a portable scalar implementation, and on x86 an SSE2 and an AVX2 implementation which
+ * classify 16 and 32 characters at a time. The best one supported by the CPU is chosen at runtime.
+ * */
+typedef struct Scanners Scanners;
+
+static inline bool isWhiteSpaceChar(char c) {
+		return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline bool isIdentifierChar(char c) {
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static inline bool isDigitChar(char c) {
+		return c >= '0' && c <= '9';
+}
+
+struct Scanners {
+		const char *name;
+		// Whitespace, as defined by isspace() in the "C" locale.
+		const char *(*skipWhiteSpace)(const char *current, const char *end, int *line);
+		// Letters, digits and '_'.
+		const char *(*skipIdentifier)(const char *current, const char *end);
+		const char *(*skipDigits)(const char *current, const char *end);
+		// Everything but '"', i.e the contents of a string literal.
+		const char *(*skipStringContents)(const char *current, const char *end, int *line);
+};
+
+extern const Scanners scalar_scanners;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCANNER_X86
+extern const Scanners sse2_scanners;
+extern const Scanners avx2_scanners;
+#endif
+
+// Returns the fastest scanners supported by the CPU running the program.
+// Defining SCANNER_SCALAR at build time always selects the scalar scanners.
+const Scanners *selectScanners();
+
+#endif
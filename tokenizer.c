@@ -4,29 +4,37 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 /* 
  * Forward declarations of all the static functions in the file.
  * There will be no duplicate declarations since all of the static functions are restricted to 
  * this specific file.
  * */
-static char *readFile(const char *source_file);
-static void addToken();
+static char *readFile(const char *source_file, int *length, bool *mapped);
+static char *readAll(int fd, int *length);
 static bool reachedEOF();
 static char eatChar();
 static char peekChar();
-static char *sliceString(int start, int end);
 static void skipWhiteSpace();
 static bool matchAndEatChar(char c);
-static void createAndPushToken(TokenType type);
-static void createAndPushIdentifier();
-static void createAndPushDigit();
-static void createAndPushString();
+static Token createToken(TokenType type);
+static Token createIdentifier();
+static Token createDigit();
+static Token createString();
 static bool isDigit(char c);
 static bool isAlpha(char c);
+static bool isStringChar(char c);
+static Token lexToken();
+static Token nextChunkToken();
 
-Tokenizer tokenizer;
+_Thread_local Tokenizer tokenizer;
 char *keywords[] = {
 		"and",
 		"class",
@@ -65,15 +73,32 @@ TokenType token_of_keyword[] = {
 	TOKEN_WHILE
 };
 
-void initToken(Token *token, TokenType type, char *lexeme, int line) {
-		token->type = type;
-		token->lexeme = lexeme;
-		token->line = line;
+// Perfect hash of the keywords: every keyword starts with a different pair of lowercase letters.
+// keyword_of_prefix[first - 'a'][second - 'a'] is the index of the keyword starting with `first`
+// and `second` in keywords[], or -1. It is generated from keywords[] by initKeywords().
+static signed char keyword_of_prefix[26][26];
+static bool keywords_initialized = false;
+
+static void initKeywords() {
+		memset(keyword_of_prefix, -1, sizeof(keyword_of_prefix));
+
+		size_t keywords_size = sizeof(keywords) / sizeof(keywords[0]);
+		for(size_t i = 0; i < keywords_size; ++i) {
+				int first = keywords[i][0] - 'a';
+				int second = keywords[i][1] - 'a';
+				CHECK(first >= 0 && first < 26 && second >= 0 && second < 26,
+								"Keywords must start with two lowercase letters");
+				CHECK(keyword_of_prefix[first][second] == -1, "Two keywords start with the same two letters");
+				keyword_of_prefix[first][second] = i;
+		}
+		keywords_initialized = true;
 }
 
-void freeToken(Token *token) {
-		free(token->lexeme);
-		initToken(token, /*type = */TOKEN_UNINITIALIZED,/*lexeme = */ NULL,/*line = */ -1);
+void initToken(Token *token, TokenType type, const char *start, int length, int line) {
+		token->type = type;
+		token->start = start;
+		token->length = length;
+		token->line = line;
 }
 
 bool tokenEquals(Token *token_a, Token *token_b) {
@@ -82,8 +107,8 @@ bool tokenEquals(Token *token_a, Token *token_b) {
 				return token_a->type == TOKEN_EOF && token_b->type == TOKEN_EOF;
 		}
 
-		return strcmp(token_a->lexeme, token_b->lexeme) == 0 && 
-				token_a->type == token_b->type;
+		return token_a->type == token_b->type && token_a->length == token_b->length &&
+				memcmp(token_a->start, token_b->start, token_a->length) == 0;
 }
 
 void initTokenizer(Tokenizer *tokenizer) {
@@ -91,124 +116,129 @@ void initTokenizer(Tokenizer *tokenizer) {
 		tokenizer->current = 0;
 		tokenizer->line = 1;
 		tokenizer->source_file = NULL;
-		initTokenizerArray(&tokenizer->token_array);
+		tokenizer->source_length = 0;
+		tokenizer->is_mapped = false;
+		tokenizer->scanners = selectScanners();
+		tokenizer->thread_count = 1;
+		tokenizer->chunks = NULL;
+		tokenizer->chunk_index = tokenizer->token_index = 0;
+		if(!keywords_initialized) initKeywords();
 }
 
 void freeTokenizer(Tokenizer *tokenizer) {
-		freeTokenizerArray(&tokenizer->token_array);
-		free(tokenizer->source_file);
-		initTokenizer(tokenizer);
-}
-
-void initTokenizerArray(TokenizerArray *tokenizer_array) {
-		tokenizer_array->array = NULL;
-		tokenizer_array->count = 0;
-		tokenizer_array->capacity = 0;
-}
-
-void freeTokenizerArray(TokenizerArray *tokenizer_array) {
-		for(int i = 0; i < tokenizer_array->count; ++i) {
-				freeToken(&tokenizer_array->array[i]);
+		if(tokenizer->is_mapped) munmap(tokenizer->source_file, tokenizer->source_length);
+		else free(tokenizer->source_file);
+		if(tokenizer->chunks != NULL) {
+				for(int i = 0; i < tokenizer->thread_count; ++i) free(tokenizer->chunks[i].tokens);
+				free(tokenizer->chunks);
 		}
-		free(tokenizer_array->array);
-		initTokenizerArray(tokenizer_array);
+		initTokenizer(tokenizer);
 }
 
-void TokenizerArray_push(TokenizerArray *tokenizer_array, Token token) {
-		if(tokenizer_array->count + 1 > tokenizer_array->capacity) {
-				tokenizer_array->capacity = tokenizer_array->capacity > 0 ? 2 * tokenizer_array->capacity : 8;
-				tokenizer_array->array = (Token *) realloc(tokenizer_array->array,
-								sizeof(Token) * tokenizer_array->capacity);
-				CHECK(tokenizer_array->array != NULL, "Failed allocating memory");
+// Assumes that the global instance of the tokenizer has been initialized.
+void tokenize(const char *filepath) {
+		tokenizer.source_file = readFile(filepath, &tokenizer.source_length, &tokenizer.is_mapped);
+		tokenizer.start = tokenizer.current = 0;
+		tokenizer.line = 1;
+
+#ifdef PARALLEL_TOKENIZER
+		if(tokenizer.source_length >= PARALLEL_TOKENIZER_MIN_SIZE) {
+				long processors = sysconf(_SC_NPROCESSORS_ONLN);
+				setTokenizerThreads(processors < TOKENIZER_MAX_THREADS ? (int) processors : TOKENIZER_MAX_THREADS);
 		}
-
-		tokenizer_array->array[tokenizer_array->count] = token;
-		tokenizer_array->count++;
+#endif
 }
 
-// Assumes that the global instance of the tokenizer has been initialized.
-void tokenize(const char *filepath) {
-		tokenizer.source_file = readFile(filepath);
+void setTokenizerThreads(int thread_count) {
+		CHECK(tokenizer.chunks == NULL, "The number of threads must be set before scanning");
+		if(thread_count <= 1) return;
 
-		while(!reachedEOF()) {
-				addToken();
-		}
+		tokenizer.thread_count = thread_count;
+		tokenizer.chunks = calloc(thread_count, sizeof(TokenChunk));
+		CHECK(tokenizer.chunks != NULL, "Failed to allocate memory");
+		// No window was scanned yet: the first call to nextChunkToken() scans one.
+		tokenizer.chunk_index = thread_count;
 }
 
 static bool reachedEOF() {
-		return tokenizer.current >= strlen(tokenizer.source_file);
+		return tokenizer.current >= tokenizer.source_length;
 }
 
-static char *sliceString(int start, int end) {
-		int string_size = end - start;
-
-		char *buffer = malloc(string_size + 1);
-		CHECK(buffer != NULL, "Failed to allocate memory");
-
-		memcpy(buffer, tokenizer.source_file + tokenizer.start, string_size);
-
-		buffer[string_size] = '\0';
-		return buffer;
+static Token createToken(TokenType type) {
+		Token token;
+		initToken(&token, type, tokenizer.source_file + tokenizer.start,
+						tokenizer.current - tokenizer.start, tokenizer.line);
+		return token;
 }
 
-/*
- * This is the function where all the tokens are created and pushed to 
- * the array of tokens of the global tokenizer.
- * */
-static void createAndPushToken(TokenType type) {
-		Token token;
-		token.line = tokenizer.line;
-		token.lexeme = sliceString(tokenizer.start, tokenizer.current);
-		token.type = type;
-		TokenizerArray_push(&tokenizer.token_array, token);
+static bool isStringChar(char c) {
+		return c != '"';
 }
 
+// Runs of characters are usually short (a space, a name), and calling a vector scanner costs more
+// than classifying a few characters. The first SCAN_INLINE_LENGTH characters of a run are classified
+// here with `in_run`, and `tokenizer.scanners->scan` only takes over the runs that go on.
+// Moves `tokenizer.current` to the end of the run, counting its newlines if `counts_lines`.
+#define SCAN_INLINE_LENGTH 8
+#define SCAN(in_run, counts_lines, scan, ...) \
+		do { \
+				const char *current = tokenizer.source_file + tokenizer.current; \
+				const char *end = tokenizer.source_file + tokenizer.source_length; \
+				const char *limit = end - current > SCAN_INLINE_LENGTH ? current + SCAN_INLINE_LENGTH : end; \
+				while(current < limit && in_run(*current)) { \
+						if(counts_lines) tokenizer.line += *current == '\n'; \
+						current++; \
+				} \
+				if(current == limit) current = tokenizer.scanners->scan(current, end, ##__VA_ARGS__); \
+				tokenizer.current = current - tokenizer.source_file; \
+		} while(false)
+
 static void skipWhiteSpace() {
-		while(!reachedEOF() && isspace(peekChar())) {
-				tokenizer.line += eatChar() == '\n';
-		}
+		SCAN(isWhiteSpaceChar, true, skipWhiteSpace, &tokenizer.line);
 }
 
-static void createAndPushIdentifier() {
-		while(!reachedEOF() && (isAlpha(peekChar()) || isDigit(peekChar()))) eatChar();
-		
-		// Compares the lexeme (char *) with all the reserved keywords and returns the corresponding TokenType
-		// if there is any match. It returns TOKEN_IDENTIFIER otherwise (If there is no match).
-		size_t keywords_size = sizeof(keywords) / sizeof(keywords[0]);
+static Token createIdentifier() {
+		SCAN(isIdentifierChar, false, skipIdentifier);
+
+		// Looks up the only keyword that can match the lexeme from its first two characters, and
+		// returns its TokenType if the whole lexeme matches. It returns TOKEN_IDENTIFIER otherwise.
+		const char *lexeme = tokenizer.source_file + tokenizer.start;
 		int lexeme_size = tokenizer.current - tokenizer.start;
-		for(int i = 0; i < keywords_size; ++i) {
-				bool same_size = lexeme_size == strlen(keywords[i]);
-				bool same_string = memcmp(tokenizer.source_file + tokenizer.start, 
-								keywords[i], lexeme_size) == 0;
-
-				if(same_size && same_string) {
-						createAndPushToken(token_of_keyword[i]);
-						return;
-				}
+		if(lexeme_size < 2) return createToken(TOKEN_IDENTIFIER);
+
+		unsigned first = lexeme[0] - 'a';
+		unsigned second = lexeme[1] - 'a';
+		if(first >= 26 || second >= 26) return createToken(TOKEN_IDENTIFIER);
+
+		int keyword = keyword_of_prefix[first][second];
+		if(keyword >= 0 && strncmp(keywords[keyword], lexeme, lexeme_size) == 0 &&
+						keywords[keyword][lexeme_size] == '\0') {
+				return createToken(token_of_keyword[keyword]);
 		}
-		createAndPushToken(TOKEN_IDENTIFIER);
+		return createToken(TOKEN_IDENTIFIER);
 }
 
-static void createAndPushDigit() {
-		while(!reachedEOF() && isDigit(peekChar())) eatChar();
+static Token createDigit() {
+		SCAN(isDigitChar, false, skipDigits);
 
 		if(matchAndEatChar('.')) {
-				while(!reachedEOF() && isDigit(peekChar())) eatChar();
+				SCAN(isDigitChar, false, skipDigits);
 		}
 		
-		createAndPushToken(TOKEN_NUMBER);
+		return createToken(TOKEN_NUMBER);
 }
 
-static void createAndPushString() {
-		while(!reachedEOF() && peekChar() != '"') eatChar();
+static Token createString() {
+		// The lexeme of a string literal does not include its quotes.
+		tokenizer.start++;
+		SCAN(isStringChar, true, skipStringContents, &tokenizer.line);
 		CHECK(!reachedEOF(), "Expected closing '\"' for a string literal");
 
-		// Eat the starting '"' of the string.
-		tokenizer.start++;
-		createAndPushToken(TOKEN_STRING);
+		Token token = createToken(TOKEN_STRING);
 
 		// Eat the enclosing '"' of the string literal.
 		eatChar();
+		return token;
 }
 
 static bool isAlpha(char c) {
@@ -221,79 +251,178 @@ static bool isDigit(char c) {
 		return c >= '0' && c <= '9';
 }
 
-static void addToken() {
+Token scanToken() {
+		if(tokenizer.thread_count > 1) return nextChunkToken();
+		return lexToken();
+}
+
+static Token lexToken() {
 		skipWhiteSpace();
 		tokenizer.start = tokenizer.current;
+		if(reachedEOF()) return createToken(TOKEN_EOF);
 		
 		char c = eatChar();
 		switch(c) {
 				case '(':
-						createAndPushToken(TOKEN_LEFT_PAREN);
-						break;
+						return createToken(TOKEN_LEFT_PAREN);
 				case ')':
-						createAndPushToken(TOKEN_RIGHT_PAREN);
-						break;
+						return createToken(TOKEN_RIGHT_PAREN);
 				case '*':
-						createAndPushToken(TOKEN_STAR);
-						break;
+						return createToken(TOKEN_STAR);
 				case '{':
-						createAndPushToken(TOKEN_LEFT_BRACE);
-						break;
+						return createToken(TOKEN_LEFT_BRACE);
 				case '}':
-						createAndPushToken(TOKEN_RIGHT_BRACE);
-						break;
+						return createToken(TOKEN_RIGHT_BRACE);
 				case '.':
-						createAndPushToken(TOKEN_DOT);
-						break;
+						return createToken(TOKEN_DOT);
 				case ',':
-						createAndPushToken(TOKEN_COMMA);
-						break;
+						return createToken(TOKEN_COMMA);
 				case ';':
-						createAndPushToken(TOKEN_SEMICOLON);
-						break;
+						return createToken(TOKEN_SEMICOLON);
 				case '+':
-						createAndPushToken(TOKEN_PLUS);
-						break;
+						return createToken(TOKEN_PLUS);
 				case '-':
-						createAndPushToken(TOKEN_MINUS);
-						break;
+						return createToken(TOKEN_MINUS);
 				case '=':
-						if(matchAndEatChar('=')) createAndPushToken(TOKEN_EQUAL_EQUAL);
-						else createAndPushToken(TOKEN_EQUAL);
-						break;
+						return createToken(matchAndEatChar('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
 				case '/':
-						createAndPushToken(TOKEN_SLASH);
-						break;
+						return createToken(TOKEN_SLASH);
 				case '<':
-						if(matchAndEatChar('=')) createAndPushToken(TOKEN_LESS_EQUAL);
-						else createAndPushToken(TOKEN_LESS);
-						break;
+						return createToken(matchAndEatChar('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
 				case '>':
-						if(matchAndEatChar('=')) createAndPushToken(TOKEN_GREATER_EQUAL);
-						else createAndPushToken(TOKEN_GREATER);
-						break;
+						return createToken(matchAndEatChar('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
 				case '!':
-						if(matchAndEatChar('=')) createAndPushToken(TOKEN_BANG_EQUAL);
-						else createAndPushToken(TOKEN_BANG);
-						break;
+						return createToken(matchAndEatChar('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
 				case '"':
-						createAndPushString();
-						break;
+						return createString();
 				case '\0':
-						createAndPushToken(TOKEN_EOF);
-						break;
+						return createToken(TOKEN_EOF);
 
 				default:
 						if(isAlpha(c)) {
-								createAndPushIdentifier();
+								return createIdentifier();
 						}
 						else if(isDigit(c)) {
-								createAndPushDigit();
-						}
-						else {
-								// Error: Unknown Token
-								CHECK(false, "Uknown Token.");
+								return createDigit();
 						}
+						// Error: Unknown Token
+						CHECK(false, "Uknown Token.");
+						return createToken(TOKEN_EOF);
+		}
+}
+
+// Skips the string literal whose opening quote is at `position`, and returns the position right
+// after its closing quote (or the end of the source), counting its lines.
+static int skipStringLiteral(int position, int *line) {
+		const char *end = tokenizer.source_file + tokenizer.source_length;
+		const char *closing = tokenizer.scanners->skipStringContents(tokenizer.source_file + position + 1, end, line);
+		return closing < end ? closing - tokenizer.source_file + 1 : tokenizer.source_length;
+}
+
+// Walks from `position`, which is outside of any string literal and at `*line`, to the first whitespace
+// character outside of a string literal at or after `target`, and returns its position. No token
+// crosses that position, so it can end a chunk.
+static int findChunkBoundary(int position, int target, int *line) {
+		const char *source = tokenizer.source_file;
+		while(position < target) {
+				int quote = tokenizer.scanners->skipStringContents(source + position, source + target, line) - source;
+				if(quote >= target) {
+						position = target;
+						break;
+				}
+				position = skipStringLiteral(quote, line);
+		}
+
+		while(position < tokenizer.source_length && !isWhiteSpaceChar(source[position])) {
+				if(source[position] == '"') position = skipStringLiteral(position, line);
+				else position++;
+		}
+		return position;
+}
+
+static void pushChunkToken(TokenChunk *chunk, Token token) {
+		if(chunk->count + 1 > chunk->capacity) {
+				chunk->capacity = chunk->capacity > 0 ? 2 * chunk->capacity : 1024;
+				chunk->tokens = realloc(chunk->tokens, sizeof(Token) * chunk->capacity);
+				CHECK(chunk->tokens != NULL, "Failed allocating memory");
+		}
+		chunk->tokens[chunk->count++] = token;
+}
+
+typedef struct {
+		TokenChunk *chunk;
+		char *source_file;
+		const Scanners *scanners;
+} ChunkJob;
+
+// Thread body: scans the tokens of a chunk with the thread local tokenizer.
+static void *scanChunk(void *argument) {
+		ChunkJob *job = argument;
+		TokenChunk *chunk = job->chunk;
+
+		initTokenizer(&tokenizer);
+		tokenizer.source_file = job->source_file;
+		tokenizer.source_length = chunk->end;
+		tokenizer.scanners = job->scanners;
+		tokenizer.current = chunk->start;
+		tokenizer.line = chunk->line;
+
+		chunk->count = 0;
+		for(Token token = lexToken(); token.type != TOKEN_EOF; token = lexToken()) {
+				pushChunkToken(chunk, token);
+		}
+		return NULL;
+}
+
+// Cuts the next window of the source in chunks and scans them in parallel.
+static void scanWindow() {
+		TokenChunk *chunks = tokenizer.chunks;
+		int position = tokenizer.current;
+		int line = tokenizer.line;
+		for(int i = 0; i < tokenizer.thread_count; ++i) {
+				chunks[i].start = position;
+				chunks[i].line = line;
+				long target = (long) position + TOKENIZER_CHUNK_SIZE;
+				position = findChunkBoundary(position, target < tokenizer.source_length ? target : tokenizer.source_length, &line);
+				chunks[i].end = position;
+		}
+		// The next window starts after this one.
+		tokenizer.current = position;
+		tokenizer.line = line;
+
+		pthread_t threads[tokenizer.thread_count];
+		ChunkJob jobs[tokenizer.thread_count];
+		for(int i = 0; i < tokenizer.thread_count; ++i) {
+				jobs[i] = (ChunkJob) { &chunks[i], tokenizer.source_file, tokenizer.scanners };
+				// The first chunk is scanned by the calling thread.
+				if(i == 0) continue;
+				CHECK(pthread_create(&threads[i], NULL, scanChunk, &jobs[i]) == 0, "Failed to create a thread");
+		}
+		Tokenizer saved = tokenizer;
+		scanChunk(&jobs[0]);
+		tokenizer = saved;
+		for(int i = 1; i < tokenizer.thread_count; ++i) {
+				CHECK(pthread_join(threads[i], NULL) == 0, "Failed to join a thread");
+		}
+
+		tokenizer.chunk_index = tokenizer.token_index = 0;
+}
+
+// Returns the next token of the chunks, scanning the next window when they are all handed out.
+static Token nextChunkToken() {
+		for(;;) {
+				while(tokenizer.chunk_index < tokenizer.thread_count) {
+						TokenChunk *chunk = &tokenizer.chunks[tokenizer.chunk_index];
+						if(tokenizer.token_index < chunk->count) return chunk->tokens[tokenizer.token_index++];
+						tokenizer.chunk_index++;
+						tokenizer.token_index = 0;
+				}
+
+				if(tokenizer.current >= tokenizer.source_length) {
+						tokenizer.start = tokenizer.current;
+						return createToken(TOKEN_EOF);
+				}
+				scanWindow();
 		}
 }
 
@@ -312,23 +441,61 @@ static char eatChar() {
 		return tokenizer.source_file[tokenizer.current - 1];
 }
 
-static char *readFile(const char *filepath) {
-		FILE *file = fopen(filepath, "r");
-		CHECK(file != NULL, "Failed to open the file");
+// Reads everything that is left in `fd` (e.g a pipe) into a malloc'ed buffer, followed by a null byte.
+static char *readAll(int fd, int *length) {
+		size_t capacity = 64 * 1024;
+		size_t size = 0;
+		char *buffer = malloc(capacity + 1);
+		CHECK(buffer != NULL, "Failed to allocate memory.");
 
-		// Get the size of the source file
-		fseek(file, /*offset = */ 0L, SEEK_END);
-		long file_size = ftell(file);
-		rewind(file);
+		for(;;) {
+				if(size == capacity) {
+						capacity *= 2;
+						buffer = realloc(buffer, capacity + 1);
+						CHECK(buffer != NULL, "Failed to allocate memory.");
+				}
+				ssize_t bytes_read = read(fd, buffer + size, capacity - size);
+				if(bytes_read < 0 && errno == EINTR) continue;
+				CHECK(bytes_read >= 0, "Failed to read the source file");
+				if(bytes_read == 0) break;
+				size += bytes_read;
+		}
 
-		char *buffer = malloc(file_size + 1);
-		CHECK(buffer != NULL, "Failed to allocate memory.");
+		CHECK(size <= INT_MAX, "Source file is too large");
+		buffer[size] = '\0';
+		*length = (int) size;
+		return buffer;
+}
 
-		// Read the contents of the file into the buffer.
-		size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
-		CHECK(bytes_read == file_size, "Failed to read the source file");
+// Returns the contents of the file and stores its size in `length`. "-" reads the standard input.
+// Regular files are mapped in memory, so that the tokenizer reads the page cache directly instead of
+// a copy; `mapped` tells whether the buffer must be unmapped or freed.
+// The buffer is only null terminated when it is not mapped: the tokenizer relies on `length`.
+static char *readFile(const char *filepath, int *length, bool *mapped) {
+		*mapped = false;
+		if(strcmp(filepath, "-") == 0) return readAll(STDIN_FILENO, length);
+
+		int fd = open(filepath, O_RDONLY);
+		CHECK(fd >= 0, "Failed to open the file");
+
+		struct stat file_stat;
+		CHECK(fstat(fd, &file_stat) == 0, "Failed to read the source file");
+
+		char *buffer;
+		if(S_ISREG(file_stat.st_mode) && file_stat.st_size > 0) {
+				CHECK(file_stat.st_size <= INT_MAX, "Source file is too large");
+				buffer = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, /*offset = */ 0);
+				CHECK(buffer != MAP_FAILED, "Failed to map the source file");
+				// The source is scanned once from start to end.
+				madvise(buffer, file_stat.st_size, MADV_SEQUENTIAL);
+				*length = (int) file_stat.st_size;
+				*mapped = true;
+		}
+		else {
+				// Pipes, character devices and empty files.
+				buffer = readAll(fd, length);
+		}
 
-		buffer[file_size] = '\0';
-		fclose(file);
+		close(fd);
 		return buffer;
 }
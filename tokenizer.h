@@ -1,11 +1,11 @@
 #ifndef COMPILER_TOKENIZER_H
 #define COMPILER_TOKENIZER_H
 
+#include "scanner.h"
 #include <stdbool.h>
 
 typedef struct Token Token;
 typedef struct Tokenizer Tokenizer;
-typedef struct TokenizerArray TokenizerArray;
 
 typedef enum {
   TOKEN_LEFT_PAREN,
@@ -52,54 +52,112 @@ typedef enum {
 
 struct Token {
 		/*
-		 * String representation of the token.
-		 * Token owns the memory of the field:
-		 *    + lexeme
+		 * String representation of the token: the `length` characters at `start`.
+		 * It is a view into `tokenizer.source_file` and is not null terminated.
 		 * */
-		char *lexeme;
+		const char *start;
+		int length;
 		TokenType type;
 		int line;
 };
-void initToken(Token *token, TokenType type, char *lexeme, int line);
-void freeToken(Token *token);
+void initToken(Token *token, TokenType type, const char *start, int length, int line);
 bool tokenEquals(Token *token_a, Token *token_b);
 
-struct TokenizerArray {
-		int count;
-		int capacity;
-		Token *array;
-};
-void initTokenizerArray(TokenizerArray *tokenizer_array);
-void freeTokenizerArray(TokenizerArray *tokenizer_array);
-void TokenizerArray_push(TokenizerArray *tokenizer_array, Token token);
-
 /*
  * There will be one global instance of this struct.
  * This will help keep track of our state (i.e src file, start column, current column, and the current line).
  * The global instance of this struct will remain in memory throughout the whole compilation process.
- * 
+ *
+ * Tokens are not stored: they are scanned one at a time when the parser asks for them, so the memory
+ * used by the tokenizer does not depend on the number of tokens.
+ *
+ * Large sources can be tokenized by several threads instead (see `thread_count`). The source is cut in
+ * windows of `thread_count` chunks of about TOKENIZER_CHUNK_SIZE bytes, at whitespace outside of string
+ * literals so that no token spans two chunks. The chunks of a window are scanned in parallel, each thread
+ * with its own instance of the tokenizer (it is thread local), and their tokens are handed out in order.
+ * Only the tokens of one window are kept in memory.
+ * tokenize() only uses threads when PARALLEL_TOKENIZER is defined, because they have not been shown to
+ * help. The only measurements were made on a single processor, where threads can only be slower, so
+ * scaling on several cores is unmeasured (benchmarkParallelTokenizer() in tokenizer_test.c measures it).
+ * Scanning and parsing do not overlap: the parser waits while a window is scanned, and the threads wait
+ * while it is parsed. At best, this divides the scanning time by `thread_count`. It can only win if that
+ * saves more than storing and reloading every token, and creating the threads of every window. Scanning
+ * the next window while the parser consumes the current one would remove the wait.
+ *
  * Tokenizer owns the memory of the fields:
- *    + token_array
- *    + source_file
+ *    + source_file, which is either mapped in memory or allocated (see `is_mapped`).
+ *    + chunks
  * */
+typedef struct TokenChunk TokenChunk;
+
 struct Tokenizer {
 		char *source_file;
-		TokenizerArray token_array;
+		int source_length;
+		bool is_mapped;
+		// Implementation of the scanners for the runs of characters, chosen by initTokenizer().
+		const Scanners *scanners;
 		int start;
 		int current;
 		int line;
+
+		// Number of threads scanning the source. With a single thread, tokens are scanned on demand.
+		int thread_count;
+		// Chunks of the current window, and the next token to hand out.
+		TokenChunk *chunks;
+		int chunk_index;
+		int token_index;
 };
+
+// Tokens of the part of the source [start, end) that starts at `line`, scanned by one thread.
+struct TokenChunk {
+		int start;
+		int end;
+		int line;
+		Token *tokens;
+		int count;
+		int capacity;
+};
+
+// With PARALLEL_TOKENIZER, sources of at least this many bytes are tokenized by several threads.
+#ifndef PARALLEL_TOKENIZER_MIN_SIZE
+#define PARALLEL_TOKENIZER_MIN_SIZE (4 * 1024 * 1024)
+#endif
+
+// Approximate number of bytes of a chunk.
+#ifndef TOKENIZER_CHUNK_SIZE
+#define TOKENIZER_CHUNK_SIZE (1024 * 1024)
+#endif
+
+#ifndef TOKENIZER_MAX_THREADS
+#define TOKENIZER_MAX_THREADS 8
+#endif
+
 void initTokenizer(Tokenizer *tokenizer);
 void freeTokenizer(Tokenizer *tokenizer);
 
 
 /* 
  * Loads the source file to memory and saves it to the tokenizer.source_file field.
- * Creates tokens from the source file and saves them to tokenizer.token_array.
+ * Regular files are mapped in memory, and "-" reads the source from the standard input.
+ * The tokens are then read one by one with scanToken().
+ * With PARALLEL_TOKENIZER, sources of at least PARALLEL_TOKENIZER_MIN_SIZE bytes are scanned by as
+ * many threads as there are processors, up to TOKENIZER_MAX_THREADS.
  * */
 void tokenize(const char *filepath);
 
-extern Tokenizer tokenizer;
+/*
+ * Sets the number of threads scanning the source loaded in the tokenizer. Must be called before
+ * the first token is scanned.
+ * */
+void setTokenizerThreads(int thread_count);
+
+/*
+ * Scans and returns the next token of the source file.
+ * Once the end of the source file is reached, it keeps returning a TOKEN_EOF.
+ * */
+Token scanToken();
+
+extern _Thread_local Tokenizer tokenizer;
 
 /*
  * keywords is an array of reserved keywords of the language.
@@ -1,54 +1,282 @@
 #include "tokenizer.c"
+#include "scanner.c"
 #include "error.h"
+#include <time.h>
 
-void PushToken(TokenType type, char *lexeme, TokenizerArray *arr) {
-		Token token;
+typedef struct {
+		TokenType type;
+		const char *lexeme;
+} ExpectedToken;
 
-		// Ownership of lex is going to be transfered to Token.
-		// Token will be responsible for freeing lex.
-		char *lex = malloc(strlen(lexeme) + 1);
-		strcpy(lex, lexeme);
-		lex[strlen(lexeme)] = '\0';
-		initToken(&token, type, lex, /*line = */-1);
-
-		TokenizerArray_push(arr, token);
+// Scans the tokens of the source file loaded in the tokenizer and compares them with `expected`,
+// which ends with a TOKEN_EOF.
+bool scanAndCompare(ExpectedToken *expected) {
+		bool result = true;
+		for(int i = 0; ; ++i) {
+				Token token = scanToken();
+				Token true_token;
+				initToken(&true_token, expected[i].type, expected[i].lexeme, strlen(expected[i].lexeme), /*line = */-1);
+				result = result && tokenEquals(&token, &true_token);
+				if(token.type == TOKEN_EOF || expected[i].type == TOKEN_EOF) break;
+		}
+		return result;
 }
 
 bool test00() {
-		bool result = true;
 		initTokenizer(&tokenizer);
 		tokenize("../test_data/tokenizer_test00.txt");
 
-		TokenizerArray true_array;
-		initTokenizerArray(&true_array);
-
-		PushToken(TOKEN_VAR, "var", &true_array);
-		PushToken(TOKEN_IDENTIFIER, "a", &true_array);
-		PushToken(TOKEN_EQUAL, "=", &true_array);
-		PushToken(TOKEN_STRING, "\"test01\"", &true_array);
-		PushToken(TOKEN_SEMICOLON, ";", &true_array);
-		PushToken(TOKEN_IF, "if", &true_array);
-		PushToken(TOKEN_LEFT_PAREN, "(", &true_array);
-		PushToken(TOKEN_IDENTIFIER, "a", &true_array);
-		PushToken(TOKEN_EQUAL_EQUAL, "==", &true_array);
-		PushToken(TOKEN_STRING, "\"test01\"", &true_array);
-		PushToken(TOKEN_RIGHT_PAREN, ")", &true_array);
-		PushToken(TOKEN_PRINT, "print", &true_array);
-		PushToken(TOKEN_STRING, "\"test02\"", &true_array);
-		PushToken(TOKEN_SEMICOLON, ";", &true_array);
-		PushToken(TOKEN_EOF, "\0", &true_array);
-
-		TokenizerArray arr = tokenizer.token_array;
-		for(int i = 0; i < arr.count; ++i) {
-				result = result && tokenEquals(&arr.array[i], &true_array.array[i]);
-		}
-
-		freeTokenizerArray(&true_array);
+		// The lexeme of a string literal does not include its quotes.
+		ExpectedToken expected[] = {
+				{ TOKEN_VAR, "var" },
+				{ TOKEN_IDENTIFIER, "a" },
+				{ TOKEN_EQUAL, "=" },
+				{ TOKEN_STRING, "test01" },
+				{ TOKEN_SEMICOLON, ";" },
+				{ TOKEN_IF, "if" },
+				{ TOKEN_LEFT_PAREN, "(" },
+				{ TOKEN_IDENTIFIER, "a" },
+				{ TOKEN_EQUAL_EQUAL, "==" },
+				{ TOKEN_STRING, "test01" },
+				{ TOKEN_RIGHT_PAREN, ")" },
+				{ TOKEN_PRINT, "print" },
+				{ TOKEN_STRING, "test02" },
+				{ TOKEN_SEMICOLON, ";" },
+				{ TOKEN_EOF, "" }
+		};
+		bool result = scanAndCompare(expected);
+
+		freeTokenizer(&tokenizer);
+		return result;
+}
+
+// Loads `source` in the tokenizer instead of a file.
+void loadSource(const char *source) {
+		initTokenizer(&tokenizer);
+		tokenizer.source_length = strlen(source);
+		tokenizer.source_file = malloc(tokenizer.source_length + 1);
+		strcpy(tokenizer.source_file, source);
+}
+
+// Keywords, and identifiers that share a prefix with a keyword.
+bool test01() {
+		loadSource("and class else false for fun if nil or print return super this true var while "
+						"an fo fora funny iff classes Var _if x whilee");
+
+		ExpectedToken expected[] = {
+				{ TOKEN_AND, "and" },
+				{ TOKEN_CLASS, "class" },
+				{ TOKEN_ELSE, "else" },
+				{ TOKEN_FALSE, "false" },
+				{ TOKEN_FOR, "for" },
+				{ TOKEN_FUN, "fun" },
+				{ TOKEN_IF, "if" },
+				{ TOKEN_NIL, "nil" },
+				{ TOKEN_OR, "or" },
+				{ TOKEN_PRINT, "print" },
+				{ TOKEN_RETURN, "return" },
+				{ TOKEN_SUPER, "super" },
+				{ TOKEN_THIS, "this" },
+				{ TOKEN_TRUE, "true" },
+				{ TOKEN_VAR, "var" },
+				{ TOKEN_WHILE, "while" },
+				{ TOKEN_IDENTIFIER, "an" },
+				{ TOKEN_IDENTIFIER, "fo" },
+				{ TOKEN_IDENTIFIER, "fora" },
+				{ TOKEN_IDENTIFIER, "funny" },
+				{ TOKEN_IDENTIFIER, "iff" },
+				{ TOKEN_IDENTIFIER, "classes" },
+				{ TOKEN_IDENTIFIER, "Var" },
+				{ TOKEN_IDENTIFIER, "_if" },
+				{ TOKEN_IDENTIFIER, "x" },
+				{ TOKEN_IDENTIFIER, "whilee" },
+				{ TOKEN_EOF, "" }
+		};
+		bool result = scanAndCompare(expected);
+
 		freeTokenizer(&tokenizer);
 		return result;
 }
 
+// Returns a source made of `line` repeated `line_count` times.
+char *repeatLine(const char *line, int line_count) {
+		size_t line_length = strlen(line);
+		char *source = malloc(line_length * line_count + 1);
+		for(int i = 0; i < line_count; ++i) {
+				memcpy(source + i * line_length, line, line_length);
+		}
+		source[line_length * line_count] = '\0';
+		return source;
+}
+
+// Every implementation of the scanners must give the same tokens and line numbers as the scalar one,
+// including for runs that cross the blocks of the vector scanners.
+// Random source of about `capacity` bytes, with every kind of token, runs of whitespace and string
+// literals over several lines.
+char *randomSource(size_t capacity) {
+		const char *pieces[] = { " ", "\n", "\t\r\n  ", "                                        \n\n ",
+				"x", "identifier_with_more_than_thirty_two_characters", "123", "1234567890123456789012345678901234.5",
+				"\"\"", "\"a string\nover\nthree lines and then some more characters to cross a block\"",
+				"+", "(", "==", ";", "var", "while" };
+		size_t piece_count = sizeof(pieces) / sizeof(pieces[0]);
+
+		srand(42);
+		char *source = malloc(capacity);
+		size_t length = 0;
+		while(length + 128 < capacity) {
+				const char *piece = pieces[rand() % piece_count];
+				memcpy(source + length, piece, strlen(piece));
+				length += strlen(piece);
+				// Tokens must be separated unless one of them is whitespace.
+				source[length++] = ' ';
+		}
+		source[length] = '\0';
+		return source;
+}
+
+// Scans both tokenizers to the end, and checks that they return the same tokens on the same lines.
+bool sameTokens(Tokenizer *expected_tokenizer, Tokenizer *actual_tokenizer) {
+		bool result = true;
+		for(;;) {
+				tokenizer = *expected_tokenizer;
+				Token expected = scanToken();
+				*expected_tokenizer = tokenizer;
+				tokenizer = *actual_tokenizer;
+				Token token = scanToken();
+				*actual_tokenizer = tokenizer;
+
+				result = result && tokenEquals(&token, &expected) && token.line == expected.line;
+				if(token.type == TOKEN_EOF || expected.type == TOKEN_EOF) break;
+		}
+		return result;
+}
+
+// All the implementations of the scanners return the same tokens as the scalar one.
+bool test02() {
+		char *source = randomSource(1 << 20);
+
+		const Scanners *implementations[] = {
+				&scalar_scanners,
+#ifdef SCANNER_X86
+				&sse2_scanners,
+				__builtin_cpu_supports("avx2") ? &avx2_scanners : &sse2_scanners,
+#endif
+		};
+		size_t implementation_count = sizeof(implementations) / sizeof(implementations[0]);
+
+		bool result = true;
+		for(size_t i = 1; i < implementation_count; ++i) {
+				Tokenizer scalar, vector;
+				loadSource(source);
+				tokenizer.scanners = implementations[0];
+				scalar = tokenizer;
+				loadSource(source);
+				tokenizer.scanners = implementations[i];
+				vector = tokenizer;
+
+				result = sameTokens(&scalar, &vector) && result;
+				freeTokenizer(&scalar);
+				freeTokenizer(&vector);
+		}
+		free(source);
+		return result;
+}
+
+// The tokens scanned by several threads are the ones scanned by a single thread, with sources of
+// several windows and chunk boundaries in the middle of runs of whitespace and string literals.
+bool test03() {
+		char *source = randomSource(5 * TOKENIZER_CHUNK_SIZE + 12345);
+		int thread_counts[] = { 2, 3, 8 };
+
+		bool result = true;
+		for(size_t i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); ++i) {
+				Tokenizer single, threaded;
+				loadSource(source);
+				single = tokenizer;
+				loadSource(source);
+				setTokenizerThreads(thread_counts[i]);
+				threaded = tokenizer;
+
+				result = sameTokens(&single, &threaded) && result;
+				freeTokenizer(&single);
+				freeTokenizer(&threaded);
+		}
+		free(source);
+		return result;
+}
+
+// Throughput of the tokenizer on `line_count` copies of `line`, in tokens per second, with each
+// implementation of the scanners available.
+void benchmarkTokenizer(const char *name, const char *line, int line_count) {
+		const Scanners *implementations[] = {
+				&scalar_scanners,
+#ifdef SCANNER_X86
+				&sse2_scanners,
+				&avx2_scanners,
+#endif
+		};
+		size_t implementation_count = sizeof(implementations) / sizeof(implementations[0]);
+
+		char *source = repeatLine(line, line_count);
+		for(size_t i = 0; i < implementation_count; ++i) {
+#ifdef SCANNER_X86
+				if(implementations[i] == &avx2_scanners && !__builtin_cpu_supports("avx2")) continue;
+#endif
+				loadSource(source);
+				tokenizer.scanners = implementations[i];
+
+				struct timespec start, end;
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				long token_count = 0;
+				while(scanToken().type != TOKEN_EOF) token_count++;
+				clock_gettime(CLOCK_MONOTONIC, &end);
+
+				double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+				printf("tokenizer (%s, %s scanners): %ld tokens in %.3f s, %.1f M tokens/s, %.0f MB/s\n",
+								name, implementations[i]->name, token_count, seconds, token_count / seconds / 1e6,
+								tokenizer.source_length / seconds / 1e6);
+				freeTokenizer(&tokenizer);
+		}
+		free(source);
+}
+
+// Throughput of the tokenizer on `line_count` copies of `line` with 1, 2, 4 and 8 threads.
+void benchmarkParallelTokenizer(const char *line, int line_count) {
+		char *source = repeatLine(line, line_count);
+		for(int thread_count = 1; thread_count <= TOKENIZER_MAX_THREADS; thread_count *= 2) {
+				loadSource(source);
+				setTokenizerThreads(thread_count);
+
+				struct timespec start, end;
+				clock_gettime(CLOCK_MONOTONIC, &start);
+				long token_count = 0;
+				while(scanToken().type != TOKEN_EOF) token_count++;
+				clock_gettime(CLOCK_MONOTONIC, &end);
+
+				double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+				printf("tokenizer (%d threads, %s scanners): %ld tokens in %.3f s, %.1f M tokens/s, %.0f MB/s\n",
+								thread_count, tokenizer.scanners->name, token_count, seconds, token_count / seconds / 1e6,
+								tokenizer.source_length / seconds / 1e6);
+				freeTokenizer(&tokenizer);
+		}
+		free(source);
+}
+
 int main(int argc, char **argv) {
 		CHECK(test00(), "Failed test00");	
+		CHECK(test01(), "Failed test01");
+		CHECK(test02(), "Failed test02");
+		CHECK(test03(), "Failed test03");
+
+		benchmarkTokenizer("code",
+						"fun update(index, value) { if (index < limit and value != nil) "
+						"{ var total = value * 2 + index; return total; } return false; }\n", 100000);
+		// Generated data definitions: indentation, long names and long string literals.
+		benchmarkTokenizer("data",
+						"                var generated_configuration_entry_identifier = "
+						"\"a long generated description of the entry, as found in data definition scripts\";\n", 100000);
+		benchmarkParallelTokenizer(
+						"fun update(index, value) { if (index < limit and value != nil) "
+						"{ var total = value * 2 + index; return total; } return false; }\n", 1000000);
 		printf("Tests Suceeded!\n");
 }
@@ -1,4 +1,5 @@
 #include "utility.h"
+#include "error.h"
 #include <stddef.h>
 #include <stdlib.h>
 
@@ -21,3 +22,54 @@ void writeByteArray(ByteArray *byte_array, uint8_t byte) {
 		byte_array->array[byte_array->count] = byte;
 		byte_array->count++;
 }
+
+struct ArenaBlock {
+		ArenaBlock *next;
+		size_t used;
+		size_t capacity;
+		max_align_t data[];
+};
+
+void initArena(Arena *arena) {
+		arena->blocks = NULL;
+}
+
+void freeArena(Arena *arena) {
+		while(arena->blocks != NULL) {
+				ArenaBlock *next = arena->blocks->next;
+				free(arena->blocks);
+				arena->blocks = next;
+		}
+}
+
+void *allocateArena(Arena *arena, size_t size) {
+		// Keep every allocation aligned for any type.
+		size = (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+
+		ArenaBlock *block = arena->blocks;
+		if(block == NULL || block->used + size > block->capacity) {
+				size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+				block = malloc(sizeof(ArenaBlock) + capacity);
+				CHECK(block != NULL, "Failed to allocate memory");
+				block->used = 0;
+				block->capacity = capacity;
+				block->next = arena->blocks;
+				arena->blocks = block;
+		}
+		void *memory = (char *) block->data + block->used;
+		block->used += size;
+		return memory;
+}
+
+ArenaMark markArena(Arena *arena) {
+		return (ArenaMark) { arena->blocks, arena->blocks != NULL ? arena->blocks->used : 0 };
+}
+
+void releaseArena(Arena *arena, ArenaMark mark) {
+		while(arena->blocks != mark.block) {
+				ArenaBlock *next = arena->blocks->next;
+				free(arena->blocks);
+				arena->blocks = next;
+		}
+		if(arena->blocks != NULL) arena->blocks->used = mark.used;
+}
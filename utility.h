@@ -1,10 +1,27 @@
 #ifndef COMPILER_UTILITY_H
 #define COMPILER_UTILITY_H
 
+#include <stddef.h>
 #include <stdint.h>
 
-// The size of the stack of our virtual machine.
-#define STACK_MAX 255
+// Initial sizes of the value stack and of the call frame stack of our virtual machine.
+// Both stacks grow on demand, up to STACK_MAX values and FRAMES_MAX frames.
+// They can be configured at build time (e.g -DSTACK_MAX=...).
+#ifndef STACK_INITIAL_CAPACITY
+#define STACK_INITIAL_CAPACITY 1024
+#endif
+
+#ifndef FRAMES_INITIAL_CAPACITY
+#define FRAMES_INITIAL_CAPACITY 64
+#endif
+
+#ifndef STACK_MAX
+#define STACK_MAX (1 << 24)
+#endif
+
+#ifndef FRAMES_MAX
+#define FRAMES_MAX (1 << 20)
+#endif
 
 // The array where the bytecode will be stored before getting executed.
 // The Bytecode is written to this array in the parsing phase.
@@ -17,10 +34,38 @@ void initByteArray(ByteArray *byte_array);
 void freeByteArray(ByteArray *byte_array);
 void writeByteArray(ByteArray *byte_array, uint8_t byte);
 
+// Bump allocator for memory that lives as long as a whole phase (e.g compilation).
+// Allocations are carved out of large blocks and are only released all at once by freeArena().
+typedef struct ArenaBlock ArenaBlock;
+typedef struct {
+		// The block being filled, followed by the older ones.
+		ArenaBlock *blocks;
+} Arena;
+
+// Size of the blocks of an arena. Larger allocations get a block of their own.
+#ifndef ARENA_BLOCK_SIZE
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#endif
+
+// Position in an arena, to release everything allocated after it (e.g at the end of a scope).
+typedef struct {
+		ArenaBlock *block;
+		size_t used;
+} ArenaMark;
+
+void initArena(Arena *arena);
+void freeArena(Arena *arena);
+void *allocateArena(Arena *arena, size_t size);
+ArenaMark markArena(Arena *arena);
+void releaseArena(Arena *arena, ArenaMark mark);
+
 // Local Variable representation
+// The name is allocated in the arena of the parser, and is only valid during compilation.
 typedef struct {
 		char *name;
 		int scope;
+		// Declaration of the variable in the instructions of the function (see ir.h).
+		int variable;
 } Local;
 
 #endif
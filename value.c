@@ -1,35 +1,34 @@
 #include "value.h"
 #include "error.h"
+#include "gc.h"
+#include "hash_table.h"
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-void freeValue(Value *value) {
-  switch (value->type) {
-  case VALUE_TYPE_STRING:
-    free(value->as.string);
-    break;
-  case VALUE_TYPE_FUNCTION:
-    freeFunction(value->as.function);
-    break;
-  }
-}
-
 void freeFunction(Function *function) {
   freeByteArray(&function->code);
-  for (int i = 0; i < function->local_top; ++i) {
-    free(function->locals[i].name);
-  }
+  freeValueArray(&function->constants);
+  free(function->locals);
+  free(function->name);
   free(function);
 }
 
-Function *createFunction(char *name) {
-  Function *function = malloc(sizeof(Function));
-  function->name = name;
+Function *createFunction(const char *name) {
+  Function *function = allocateObject(sizeof(Function), OBJECT_FUNCTION);
+  function->name = malloc(strlen(name) + 1);
+  CHECK(function->name != NULL, "Failed to allocate memory");
+  strcpy(function->name, name);
+  function->locals = NULL;
   function->local_top = 0;
+  function->local_capacity = 0;
   function->arity = 0;
+  function->stack_depth = 0;
+  function->max_stack_depth = 0;
   initByteArray(&function->code);
+  initValueArray(&function->constants);
+  return function;
 }
 
 void initClosure(Closure *closure) {
@@ -73,50 +72,120 @@ void writeClosureArray(ClosureArray *closure_array, uint8_t stack_pos) {
 
 bool valueEquals(Value *this, Value *other) {
 
-  if (this->type != other->type)
+  if (VALUE_TYPE(*this) != VALUE_TYPE(*other))
     return false;
-  switch (this->type) {
+  switch (VALUE_TYPE(*this)) {
   case VALUE_TYPE_NIL:
     return true;
   case VALUE_TYPE_STRING:
-    return strcmp(this->as.string, other->as.string) == 0;
+    return AS_STRING(*this) == AS_STRING(*other);
   case VALUE_TYPE_BOOLEAN:
-    return this->as.boolean == other->as.boolean;
+    return AS_BOOLEAN(*this) == AS_BOOLEAN(*other);
   case VALUE_TYPE_NUMBER:
-    return this->as.number == other->as.number;
+    return AS_NUMBER(*this) == AS_NUMBER(*other);
   case VALUE_TYPE_FUNCTION:
-    return !strcmp(this->as.function->name, other->as.function->name);
+    return !strcmp(AS_FUNCTION(*this)->name, AS_FUNCTION(*other)->name);
   default:
     CHECK(false, "Unreachable state");
     return false;
   }
 }
 
+// Hash consistent with valueEquals(): equal values have equal hashes.
+static uint32_t hashValue(Value *value) {
+  switch (VALUE_TYPE(*value)) {
+  case VALUE_TYPE_NIL:
+    return 0;
+  case VALUE_TYPE_BOOLEAN:
+    return AS_BOOLEAN(*value) ? 1 : 2;
+  case VALUE_TYPE_NUMBER: {
+    // 0.0 and -0.0 compare equal but have different representations.
+    double number = AS_NUMBER(*value) == 0 ? 0 : AS_NUMBER(*value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+  }
+  case VALUE_TYPE_STRING:
+    return AS_STRING(*value)->hash;
+  case VALUE_TYPE_FUNCTION:
+    return hash(AS_FUNCTION(*value)->name);
+  default:
+    CHECK(false, "Unreachable state");
+    return 0;
+  }
+}
+
+// Constants are only shared when they are the same value: unlike valueEquals(),
+// 0 and -0 are different constants (they print differently), and NaN is the
+// same constant as itself.
+static bool sameConstant(Value *this, Value *other) {
+  if (IS_NUMBER(*this) && IS_NUMBER(*other)) {
+    double this_number = AS_NUMBER(*this), other_number = AS_NUMBER(*other);
+    return memcmp(&this_number, &other_number, sizeof(double)) == 0;
+  }
+  return valueEquals(this, other);
+}
+
+// Returns the slot of `index` where `value` is stored, or the empty slot
+// where it should be inserted.
+static int findIndexSlot(ValueArray *value_array, Value *value) {
+  int mask = value_array->index_capacity - 1;
+  int slot = hashValue(value) & mask;
+  while (value_array->index[slot] != 0 &&
+         !sameConstant(&value_array->array[value_array->index[slot] - 1],
+                       value)) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+// Rebuilds the index with twice the capacity (or with the capacity the values
+// need, if it was dropped). The index is kept at most half full.
+static void growIndex(ValueArray *value_array) {
+  free(value_array->index);
+  value_array->index_capacity =
+      value_array->index_capacity > 0 ? 2 * value_array->index_capacity : 16;
+  while (2 * (value_array->count + 1) > value_array->index_capacity) {
+    value_array->index_capacity *= 2;
+  }
+  value_array->index = calloc(value_array->index_capacity, sizeof(int));
+  CHECK(value_array->index != NULL, "Failed to allocate memory");
+
+  for (int i = 0; i < value_array->count; ++i) {
+    int slot = findIndexSlot(value_array, &value_array->array[i]);
+    value_array->index[slot] = i + 1;
+  }
+}
+
 void initValueArray(ValueArray *value_array) {
   value_array->count = 0;
   value_array->capacity = 0;
   value_array->array = NULL;
+  value_array->index = NULL;
+  value_array->index_capacity = 0;
 }
 
 void freeValueArray(ValueArray *value_array) {
-  // Free all the values inside the value_array before freeing the value_array
-  // itself.
-  for (int i = 0; i < value_array->count; ++i) {
-    freeValue(&value_array->array[i]);
-  }
   free(value_array->array);
+  free(value_array->index);
   initValueArray(value_array);
 }
 
 // Grow the array when the number of elements reaches the max capacity of the
 // array.
-uint8_t writeValueArray(ValueArray *value_array, Value value) {
-  // Check if this value is already in the array
-  for (int i = 0; i < value_array->count; ++i) {
-    if (valueEquals(&value_array->array[i], &value))
-      return i;
+int writeValueArray(ValueArray *value_array, Value value) {
+  if (2 * (value_array->count + 1) > value_array->index_capacity) {
+    growIndex(value_array);
   }
 
+  // Check if this value is already in the array
+  int slot = findIndexSlot(value_array, &value);
+  if (value_array->index[slot] != 0)
+    return value_array->index[slot] - 1;
+
   if (value_array->count + 1 > value_array->capacity) {
     value_array->capacity =
         value_array->capacity > 0 ? 2 * value_array->capacity : 8;
@@ -125,5 +194,183 @@ uint8_t writeValueArray(ValueArray *value_array, Value value) {
   }
   value_array->array[value_array->count] = value;
   value_array->count++;
+  value_array->index[slot] = value_array->count;
   return value_array->count - 1;
 }
+
+void truncateValueArray(ValueArray *value_array, int count) {
+  int mask = value_array->index_capacity - 1;
+  while (value_array->count > count) {
+    int slot = findIndexSlot(value_array,
+                             &value_array->array[value_array->count - 1]);
+    value_array->count--;
+
+    // Backward shift deletion: move back the entries of the probe sequence
+    // that follows the removed one, so that no lookup stops too early.
+    int hole = slot;
+    for (int next = (slot + 1) & mask; value_array->index[next] != 0;
+         next = (next + 1) & mask) {
+      int home =
+          hashValue(&value_array->array[value_array->index[next] - 1]) & mask;
+      // Entries whose home slot is cyclically in (hole, next] stay in place.
+      bool stays = hole <= next ? (hole < home && home <= next)
+                                : (hole < home || home <= next);
+      if (stays)
+        continue;
+      value_array->index[hole] = value_array->index[next];
+      hole = next;
+    }
+    value_array->index[hole] = 0;
+  }
+}
+
+void compactValueArray(ValueArray *value_array, int *positions) {
+  int count = 0;
+  for (int i = 0; i < value_array->count; ++i) {
+    if (positions[i] < 0)
+      continue;
+    value_array->array[count] = value_array->array[i];
+    positions[i] = count++;
+  }
+  value_array->count = count;
+
+  // The values were already distinct, and the index is only needed to add
+  // more: it is rebuilt on the next write.
+  free(value_array->index);
+  value_array->index = NULL;
+  value_array->index_capacity = 0;
+}
+
+// Set of all the strings created by the program. Open addressing with linear
+// probing and a power of two capacity, kept at most half full. `count`
+// includes the tombstones left by collected strings.
+static struct {
+  int count;
+  int capacity;
+  String **array;
+} strings;
+
+// Marks the slot of a string removed by the garbage collector, so that probing
+// goes on past it.
+static char tombstone;
+#define TOMBSTONE ((String *)&tombstone)
+
+// Returns the slot of `strings` holding the string with the given characters,
+// or the slot where it should be inserted (preferably a tombstone).
+static int findStringSlot(const char *chars, int length, uint32_t hash) {
+  int mask = strings.capacity - 1;
+  int slot = hash & mask;
+  int first_tombstone = -1;
+  for (;;) {
+    String *string = strings.array[slot];
+    if (string == NULL)
+      return first_tombstone >= 0 ? first_tombstone : slot;
+    if (string == TOMBSTONE) {
+      if (first_tombstone < 0)
+        first_tombstone = slot;
+    } else if (string->hash == hash && string->length == length &&
+               memcmp(string->chars, chars, length) == 0) {
+      return slot;
+    }
+    slot = (slot + 1) & mask;
+  }
+}
+
+static bool isLiveString(String *string) {
+  return string != NULL && string != TOMBSTONE;
+}
+
+// Rebuilds the table without its tombstones, doubling the capacity until the
+// live strings fill at most a quarter of it. internString() rebuilds at half
+// full, so the live strings can double before the next rebuild.
+static void growStrings() {
+  String **old_array = strings.array;
+  int old_capacity = strings.capacity;
+
+  int live_count = 0;
+  for (int i = 0; i < old_capacity; ++i) {
+    live_count += isLiveString(old_array[i]);
+  }
+
+  strings.capacity = old_capacity > 0 ? old_capacity : 64;
+  while (4 * (live_count + 1) > strings.capacity) {
+    strings.capacity *= 2;
+  }
+  strings.array = calloc(strings.capacity, sizeof(String *));
+  CHECK(strings.array != NULL, "Failed to allocate memory");
+  strings.count = live_count;
+
+  for (int i = 0; i < old_capacity; ++i) {
+    String *string = old_array[i];
+    if (!isLiveString(string))
+      continue;
+    strings.array[findStringSlot(string->chars, string->length,
+                                 string->hash)] = string;
+  }
+  free(old_array);
+}
+
+// Interns `candidate`, the most recently allocated object, which nobody refers
+// to yet. If an equal string already exists, `candidate` is freed and the
+// existing string is returned instead.
+static String *internString(String *candidate) {
+  if (2 * (strings.count + 1) > strings.capacity) {
+    growStrings();
+  }
+
+  int slot = findStringSlot(candidate->chars, candidate->length,
+                            candidate->hash);
+  if (isLiveString(strings.array[slot])) {
+    discardObject((Object *)candidate);
+    shadeObject((Object *)strings.array[slot]);
+    return strings.array[slot];
+  }
+  strings.count += strings.array[slot] == NULL;
+  strings.array[slot] = candidate;
+  return candidate;
+}
+
+static String *allocateString(int length) {
+  String *string = allocateObject(sizeof(String) + length + 1, OBJECT_STRING);
+  string->length = length;
+  string->chars[length] = '\0';
+  return string;
+}
+
+String *copyString(const char *chars, int length) {
+  uint32_t hash = hashBytes(chars, length);
+  if (strings.capacity > 0) {
+    // Avoid allocating when the string already exists.
+    int slot = findStringSlot(chars, length, hash);
+    if (isLiveString(strings.array[slot])) {
+      shadeObject((Object *)strings.array[slot]);
+      return strings.array[slot];
+    }
+  }
+
+  String *string = allocateString(length);
+  memcpy(string->chars, chars, length);
+  string->hash = hash;
+  return internString(string);
+}
+
+String *concatenateStrings(String *lhs, String *rhs) {
+  String *string = allocateString(lhs->length + rhs->length);
+  memcpy(string->chars, lhs->chars, lhs->length);
+  memcpy(string->chars + lhs->length, rhs->chars, rhs->length);
+  string->hash = hashBytes(string->chars, string->length);
+  return internString(string);
+}
+
+void removeString(String *string) {
+  int slot = findStringSlot(string->chars, string->length, string->hash);
+  CHECK(strings.array[slot] == string, "String is not interned");
+  strings.array[slot] = TOMBSTONE;
+}
+
+void freeStrings() {
+  free(strings.array);
+  strings.count = 0;
+  strings.capacity = 0;
+  strings.array = NULL;
+}
@@ -5,14 +5,114 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+typedef struct ValueArray ValueArray;
+typedef struct String String;
+typedef enum ValueType ValueType;
+
+// ValueType defines the types supported for this language.
+enum ValueType {
+  VALUE_TYPE_NUMBER,
+  VALUE_TYPE_NIL,
+  VALUE_TYPE_BOOLEAN,
+  VALUE_TYPE_STRING,
+  VALUE_TYPE_FUNCTION
+};
+
+// Kinds of heap allocated objects.
+typedef enum { OBJECT_STRING, OBJECT_FUNCTION } ObjectType;
+
+// Header shared by all heap allocated objects (strings and functions).
+// Objects are owned by the garbage collector (see gc.h), which links all of
+// them through `next` and frees the ones that are no longer reachable.
+// `is_old` tells the generation of the object, and `mark` is the epoch of the
+// last major collection that found it reachable.
+typedef struct Object Object;
+struct Object {
+  ObjectType type;
+  bool is_old;
+  uint32_t mark;
+  Object *next;
+};
+
+// Values are created, checked and read only through the macros below, so that
+// their representation can be chosen at build time:
+//   + By default a Value is a tagged union (16 bytes).
+//   + With NAN_BOXING defined, a Value is a single 64-bit word (8 bytes).
+//     Numbers are stored as plain doubles. Every other value is stored inside
+//     the payload of a quiet NaN, which no arithmetic operation produces:
+//       - nil, false and true are the quiet NaN with the tag 1, 2 and 3.
+//       - strings and functions are the quiet NaN with the sign bit set and
+//         the pointer in the low 48 bits. Bit 48 tells functions from strings.
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+typedef uint64_t Value;
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+#define TAG_NIL 1
+#define TAG_FALSE 2
+#define TAG_TRUE 3
+#define TAG_FUNCTION ((uint64_t)1 << 48)
+#define OBJECT_MASK (SIGN_BIT | QNAN | TAG_FUNCTION)
+#define POINTER_MASK ((uint64_t)0x0000ffffffffffff)
+
+static inline Value numberToValue(double number) {
+  Value value;
+  memcpy(&value, &number, sizeof(number));
+  return value;
+}
+
+static inline double valueToNumber(Value value) {
+  double number;
+  memcpy(&number, &value, sizeof(number));
+  return number;
+}
+
+#define CREATE_NUMBER(value) numberToValue(value)
+#define CREATE_BOOLEAN(value) ((Value)(QNAN | ((value) ? TAG_TRUE : TAG_FALSE)))
+#define CREATE_STRING(value) ((Value)(SIGN_BIT | QNAN | (uintptr_t)(value)))
+#define CREATE_NIL(value) ((Value)(QNAN | TAG_NIL))
+#define CREATE_FUNCTION(value)                                                 \
+  ((Value)(SIGN_BIT | QNAN | TAG_FUNCTION | (uintptr_t)(value)))
+
+#define IS_NUMBER(value) (((value)&QNAN) != QNAN)
+#define IS_BOOLEAN(value) (((value) | 1) == (QNAN | TAG_TRUE))
+#define IS_STRING(value) (((value)&OBJECT_MASK) == (SIGN_BIT | QNAN))
+#define IS_NIL(value) ((value) == (QNAN | TAG_NIL))
+#define IS_FUNCTION(value) (((value)&OBJECT_MASK) == OBJECT_MASK)
+
+#define AS_NUMBER(value) valueToNumber(value)
+#define AS_BOOLEAN(value) ((value) == (QNAN | TAG_TRUE))
+#define AS_STRING(value) ((String *)(uintptr_t)((value)&POINTER_MASK))
+#define AS_FUNCTION(value) ((Function *)(uintptr_t)((value)&POINTER_MASK))
+
+static inline ValueType valueType(Value value) {
+  if (IS_NUMBER(value))
+    return VALUE_TYPE_NUMBER;
+  if (IS_NIL(value))
+    return VALUE_TYPE_NIL;
+  if (IS_BOOLEAN(value))
+    return VALUE_TYPE_BOOLEAN;
+  if (IS_STRING(value))
+    return VALUE_TYPE_STRING;
+  return VALUE_TYPE_FUNCTION;
+}
+#define VALUE_TYPE(value) valueType(value)
+
+#else
+
+typedef struct Value Value;
+
 // Creates a Value and initializes its number field with value.
 #define CREATE_NUMBER(value) ((Value){VALUE_TYPE_NUMBER, {.number = value}})
 
 // Creates a Value and initializes its boolean field with value.
 #define CREATE_BOOLEAN(value) ((Value){VALUE_TYPE_BOOLEAN, {.boolean = value}})
 
-// Creates a Value and initializes its string field with value of type (char *).
-// Value owns the memory of the string field.
+// Creates a Value and initializes its string field with value of type
+// (String *). The string must come from copyString() or concatenateStrings().
 #define CREATE_STRING(value) ((Value){VALUE_TYPE_STRING, {.string = value}})
 
 // Creates a Value of type VALUE_TYPE_NIL that does not contain any data.
@@ -29,27 +129,91 @@
 #define IS_NIL(value) ((value).type == VALUE_TYPE_NIL)
 #define IS_FUNCTION(value) ((value).type == VALUE_TYPE_FUNCTION)
 
-typedef struct Value Value;
-typedef struct ValueArray ValueArray;
-typedef enum ValueType ValueType;
+#define AS_NUMBER(value) ((value).as.number)
+#define AS_BOOLEAN(value) ((value).as.boolean)
+#define AS_STRING(value) ((value).as.string)
+#define AS_FUNCTION(value) ((value).as.function)
 
-// ValueType defines the types supported for this language.
-enum ValueType {
-  VALUE_TYPE_NUMBER,
-  VALUE_TYPE_NIL,
-  VALUE_TYPE_BOOLEAN,
-  VALUE_TYPE_STRING,
-  VALUE_TYPE_FUNCTION
+#define VALUE_TYPE(value) ((value).type)
+
+#endif
+
+// The characters of a string Value as a null terminated (char *).
+#define AS_CSTRING(value) (AS_STRING(value)->chars)
+
+// Immutable string object. Strings are interned: there is only one String
+// for a given sequence of characters, so strings can be compared by pointer.
+// The intern table only holds weak references: unreachable strings are
+// removed from it by the garbage collector.
+struct String {
+  Object object;
+  int length;
+  // Cached hash of the characters, so that tables never hash them again.
+  uint32_t hash;
+  // `length` characters followed by a terminating null byte.
+  char chars[];
 };
 
+// Returns the interned String holding the `length` first characters of
+// `chars`, creating it if needed.
+String *copyString(const char *chars, int length);
+
+// Returns the interned String holding `lhs` followed by `rhs`.
+String *concatenateStrings(String *lhs, String *rhs);
+
+// Removes a string that is about to be collected from the intern table.
+void removeString(String *string);
+
+// Frees the intern table itself. The strings are freed by the collector.
+void freeStrings();
+
+// Array of values(i.e strings, numbers, booleans, ....). It is used for the
+// constant pool of each function.
+// The array does not own the objects its values refer to: they are owned by
+// the garbage collector.
+struct ValueArray {
+  int count;
+  int capacity;
+  Value *array;
+  // Open addressing index (linear probing, power of two capacity) from a value
+  // to its position in `array`, used to deduplicate values in O(1).
+  // Slots hold the position + 1, 0 marks an empty slot.
+  int *index;
+  int index_capacity;
+};
+void initValueArray(ValueArray *value_array);
+void freeValueArray(ValueArray *value_array);
+
+// Returns the position of the inserted value in the value_array.
+int writeValueArray(ValueArray *value_array, Value value);
+
+// Removes the values from position `count` onwards, e.g the constants of bytecode that was
+// discarded by the compiler.
+void truncateValueArray(ValueArray *value_array, int count);
+
+// Removes the values whose entry in `positions` is negative, keeping the order
+// of the others, and stores the new position of each kept value in
+// `positions`.
+void compactValueArray(ValueArray *value_array, int *positions);
+
 typedef struct {
+  Object object;
   ByteArray code;
-  Local locals[STACK_MAX];
+  // Constant pool of the function. OP_VALUE and OP_CONSTANT_LONG index into it.
+  ValueArray constants;
+  Local *locals;
   int local_top;
+  int local_capacity;
   int arity;
+  // Number of stack slots used by the function at the current point of
+  // compilation, and the maximum it reaches. The VM reserves
+  // `max_stack_depth` slots on function entry.
+  int stack_depth;
+  int max_stack_depth;
   char *name;
 } Function;
-Function *createFunction(char *name);
+// Creates a function named after a copy of `name`.
+Function *createFunction(const char *name);
 void freeFunction(Function *function);
 
 typedef struct {
@@ -61,19 +225,30 @@ typedef struct {
 // Value is the runtime representation of our program's data.
 // Data inside Value can be of any type among the types defined in the enum
 // ValueType.
-// Value owns the memory of heap allocated objects it may have.
+// Heap allocated objects a Value may refer to are owned by the garbage
+// collector.
+#ifndef NAN_BOXING
 struct Value {
   ValueType type;
   union {
     double number;
     bool boolean;
-    char *string;
+    String *string;
     Function *function;
   } as;
 };
-void freeValue(Value *value);
+#endif
 bool valueEquals(Value *this, Value *other);
 
+// Conditions treat nil and false as false, and every other value as true.
+static inline bool isTrue(Value value) {
+  if (IS_NIL(value))
+    return false;
+  if (IS_BOOLEAN(value))
+    return AS_BOOLEAN(value);
+  return true;
+}
+
 typedef struct {
   int count;
   int capacity;
@@ -93,20 +268,6 @@ typedef struct {
 void initClosure(Closure *closure);
 void freeClosure(Closure *closure);
 
-// Array where all the values(i.e strings, numbers, booleans, ....) are stored.
-// All the objects will remain in the array even if they are popped from the
-// stack. This is in order to be able to free all the allocations after the
-// program is done.
-struct ValueArray {
-  int count;
-  int capacity;
-  Value *array;
-};
-void initValueArray(ValueArray *value_array);
-void freeValueArray(ValueArray *value_array);
-
-// Returns the position of the inserted value in the value_array.
-uint8_t writeValueArray(ValueArray *value_array, Value value);
 
 extern Function *current_function;
 extern Function *global_function;
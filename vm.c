@@ -1,327 +1,532 @@
 #include "vm.h"
 #include "debug.h"
 #include "error.h"
+#include "gc.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static void decodeInstruction(OpCode op_code);
-static void getHandler(bool is_local);
-
 VM vm;
 CallFrame *current_frame;
 
 void initVM(VM *vm) {
+		vm->frames = malloc(sizeof(CallFrame) * FRAMES_INITIAL_CAPACITY);
+		vm->frame_top = 0;
+		vm->frame_capacity = FRAMES_INITIAL_CAPACITY;
+
+		vm->stack = malloc(sizeof(Value) * STACK_INITIAL_CAPACITY);
 		vm->stack_top = 0;
+		vm->stack_capacity = STACK_INITIAL_CAPACITY;
+		CHECK(vm->frames != NULL && vm->stack != NULL, "Failed to allocate memory");
+
+		vm->globals = NULL;
+		vm->global_count = vm->global_capacity = 0;
+
 		vm->scope = 0;
-		initValueArray(&vm->value_array);
 		initHashTable(&vm->table);
 }
 
 void freeVM(VM *vm) {
-		freeValueArray(&vm->value_array);
 		freeHashTable(&vm->table);
-		freeFunction(current_function);
-		initVM(vm);
-}
-
-void push(Value value) {
-		CHECK(vm.stack_top < STACK_MAX, "Stack Overflow!");
-		vm.stack[vm.stack_top++] = value;
-}
-
-Value pop() {
-		CHECK(vm.stack_top > 0, "Trying to pop an element from an empty Stack!");
-		vm.stack_top--;
-		return vm.stack[vm.stack_top];
-}
-
-static void additionHandler() {
-		Value rhs = pop();
-		Value lhs = pop();
-
-		CHECK((IS_NUMBER(lhs) && IS_NUMBER(rhs)) ||
-						(IS_STRING(lhs) && IS_STRING(rhs)), "Both Operands of '+' must be numbers or strings.");
-
-		if(IS_NUMBER(lhs) && IS_NUMBER(rhs)) {
-				push(CREATE_NUMBER(lhs.as.number + rhs.as.number));
-		}
-		else {
-				char *lhs_string = lhs.as.string;
-				char *rhs_string = rhs.as.string;
-				
-				size_t concat_size = strlen(lhs_string) + strlen(rhs_string);
-				char *concat_string = malloc(concat_size + 1);
-
-				memcpy(concat_string, lhs_string, strlen(lhs_string));
-				memcpy(concat_string + strlen(lhs_string), rhs_string, strlen(rhs_string));
-				concat_string[concat_size] = '\0';
-				
-				Value new_value = CREATE_STRING(concat_string);
-				push(new_value);
-				// Push to value array in order for the new value to be freed at the end
-				// of the program.
-				writeValueArray(&vm.value_array, new_value);
-		}
-		current_frame->ip++;
-}
-
-static void substractionHandler() {
-		BINARY_OP(-, CREATE_NUMBER);
-		current_frame->ip++;
-}
-
-static void multiplicationHandler() {
-		BINARY_OP(*, CREATE_NUMBER);
-		current_frame->ip++;
-}
-
-static void divisionHandler() {
-		BINARY_OP(/, CREATE_NUMBER);
-		current_frame->ip++;
-}
-
-static void valueHandler() {
-		uint8_t pos_on_value_array = current_frame->function->code.array[current_frame->ip + 1];
-		Value value = vm.value_array.array[pos_on_value_array];
-		push(value);
-		current_frame->ip += 2;
-}
-
-static void lessHandler() {
-		BINARY_OP(<, CREATE_BOOLEAN);
-		current_frame->ip++;
-}
-
-static void lessEqualHandler() {
-		BINARY_OP(<=, CREATE_BOOLEAN);
-		current_frame->ip++;
-}
-
-static void equalEqualHandler() {
-		BINARY_OP(==, CREATE_BOOLEAN);
-		current_frame->ip++;
-} 
-
-static void greaterHandler() {
-		BINARY_OP(>, CREATE_BOOLEAN);
-		current_frame->ip++;
-}
-
-static void greaterEqualHandler() {
-		BINARY_OP(>=, CREATE_BOOLEAN);
-		current_frame->ip++;
-} 
-
-static void bangEqualHandler() {
-		BINARY_OP(!=, CREATE_BOOLEAN);
-		current_frame->ip++;
-}
-
-static void notHandler() {
-		CHECK(vm.stack_top > 0, "Trying to access an element from an Empty Stack!");
-		Value *top = &vm.stack[vm.stack_top - 1];
-
-		CHECK(IS_BOOLEAN(*top), "Operand of '!' operator must be a boolean!");
-		top->as.boolean = !(top->as.boolean);
-		current_frame->ip++;
-}
-
-static void negateHandler() {
-		CHECK(vm.stack_top > 0, "Trying to access an element from an Empty Stack!");
-		Value *top = &vm.stack[vm.stack_top - 1];
-
-		CHECK(IS_NUMBER(*top), "Operand of '-' operator must be a number!");
-		top->as.number = -(top->as.number);
-		current_frame->ip++;
-}
-
-static void getHandler(bool is_local) {
-		// OP_GET OP_VALUE index_on_value_array
-		//   ^
-		//  current_frame->ip
-
-		uint8_t pos_on_value_array = current_frame->function->code.array[current_frame->ip + 2];
-		uint8_t pos_on_stack = vm.value_array.array[pos_on_value_array].as.number
-				+ is_local * (current_frame->fn_stack_top + 1);
-		push(vm.stack[pos_on_stack]);
-		current_frame->ip += 3;
+		freeObjects();
+		freeStrings();
+
+		free(vm->frames);
+		free(vm->stack);
+		vm->frames = NULL;
+		vm->frame_top = vm->frame_capacity = 0;
+		vm->stack = NULL;
+		vm->stack_top = vm->stack_capacity = 0;
+		free(vm->globals);
+		vm->globals = NULL;
+		vm->global_count = vm->global_capacity = 0;
+		vm->scope = 0;
 }
 
-static void assignHandler(bool is_local) {
-		// OP_GET OP_VALUE index_on_value_array
-		//   ^
-		//  current_frame->ip
+// Grows the value stack so that it can hold at least `required` values.
+// Pointers into the stack are invalidated.
+static void growStack(int required) {
+		CHECK(required <= STACK_MAX, "Stack Overflow!");
 
-		uint8_t pos_on_value_array = current_frame->function->code.array[current_frame->ip + 2];
-		uint8_t pos_on_stack = vm.value_array.array[pos_on_value_array].as.number 
-				+ is_local * (current_frame->fn_stack_top + 1);
-		vm.stack[pos_on_stack] = vm.stack[vm.stack_top - 1];
-		current_frame->ip += 3;
-}
+		int capacity = vm.stack_capacity;
+		while(capacity < required) capacity *= 2;
+		if(capacity > STACK_MAX) capacity = STACK_MAX;
 
-static bool isTrue(Value value) {
-		if(value.type == VALUE_TYPE_NIL) return false;
-		if(value.type == VALUE_TYPE_BOOLEAN) return value.as.boolean;
-		return true;
+		vm.stack = realloc(vm.stack, sizeof(Value) * capacity);
+		CHECK(vm.stack != NULL, "Failed to allocate memory");
+		vm.stack_capacity = capacity;
 }
 
-static void jumpIfFalseHandler() {
-		uint16_t jump_size = (current_frame->function->code.array[current_frame->ip + 1] << 8) 
-				| current_frame->function->code.array[current_frame->ip + 2];
-		current_frame->ip += !isTrue(pop()) ? jump_size : 3;
-}
-
-static void jumpHandler() {
-		uint16_t jump_size = (current_frame->function->code.array[current_frame->ip + 1] << 8)
-				| current_frame->function->code.array[current_frame->ip + 2];
-		current_frame->ip += jump_size;
+int addGlobal() {
+		if(vm.global_count + 1 > vm.global_capacity) {
+				vm.global_capacity = vm.global_capacity > 0 ? 2 * vm.global_capacity : 64;
+				vm.globals = realloc(vm.globals, sizeof(Value) * vm.global_capacity);
+				CHECK(vm.globals != NULL, "Failed to allocate memory");
+		}
+		vm.globals[vm.global_count] = CREATE_NIL();
+		return vm.global_count++;
 }
 
-static void jumpBackwardHandler() {
-		uint16_t jump_size = (current_frame->function->code.array[current_frame->ip + 1] << 8)
-				| current_frame->function->code.array[current_frame->ip + 2];
-		current_frame->ip -= jump_size;
-}
+// Grows the call frame stack by a factor of two.
+// Pointers into the frame stack are invalidated.
+static void growFrames() {
+		CHECK(vm.frame_capacity < FRAMES_MAX, "Stack Overflow!");
 
-static void printHandler() {
-		Value to_print = pop();
+		int capacity = 2 * vm.frame_capacity;
+		if(capacity > FRAMES_MAX) capacity = FRAMES_MAX;
 
-		printValue(&to_print);
-		printf("\n");
-		current_frame->ip++;
+		vm.frames = realloc(vm.frames, sizeof(CallFrame) * capacity);
+		CHECK(vm.frames != NULL, "Failed to allocate memory");
+		vm.frame_capacity = capacity;
 }
 
-void callFunction(Function *function, int arity) {
-		CallFrame *previous_frame = current_frame;
-		CallFrame *new_frame = &vm.frames[vm.frame_top++];
-		new_frame->function = function;
-		new_frame->ip = 0;
-		new_frame->fn_stack_top = vm.stack_top - arity - 1;
-
-		current_frame = new_frame;
-		decode();
-
-		vm.frame_top--;
-		Value return_value = pop();
-		current_frame = previous_frame;
-		vm.stack_top = new_frame->fn_stack_top;
-		push(return_value);
+void push(Value value) {
+		CHECK(vm.stack_top < vm.stack_capacity, "Stack Overflow!");
+		vm.stack[vm.stack_top++] = value;
 }
 
-static void callHandler() {
-		current_frame->ip++;
-		valueHandler();
-
-		int arity = (int) pop().as.number;
-		Value function = vm.stack[vm.stack_top - arity - 1];
-
-		CHECK(IS_FUNCTION(function), "not a function");
-
-		CHECK(function.as.function->arity == arity, "Wrong number of arguments");
-
-		callFunction(function.as.function, arity);
+Value pop() {
+		CHECK(vm.stack_top > 0, "Trying to pop an element from an empty Stack!");
+		vm.stack_top--;
+		return vm.stack[vm.stack_top];
 }
 
-static void returnHandler() {
-		current_frame->ip = current_frame->function->code.count;
-}
+/*
+ * Threaded dispatch relies on the "labels as values" GNU extension: every instruction ends
+ * by jumping straight to the handler of the next one through `dispatch_table`, instead of going
+ * back to the top of a loop and through the bounds check of a switch.
+ * Define VM_SWITCH_DISPATCH (or use a compiler without the extension) to get the portable
+ * switch based loop.
+ * */
+#if defined(__GNUC__) && !defined(VM_SWITCH_DISPATCH)
+#define VM_COMPUTED_GOTO
+#endif
+
+/*
+ * Define VM_COUNT_DISPATCHES to count the instructions the VM dispatches, which `interpret()`
+ * prints to stderr. It measures how many instructions the optimizer saves (see
+ * benchmark/dispatch.sh).
+ * */
+#ifdef VM_COUNT_DISPATCHES
+static unsigned long long dispatch_count;
+#define COUNT_DISPATCH() (dispatch_count++)
+#else
+#define COUNT_DISPATCH() ((void) 0)
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+#define TARGET(op) case op: label_##op
+#define DISPATCH() do { COUNT_DISPATCH(); goto *dispatch_table[*ip++]; } while(false)
+#else
+#define TARGET(op) case op
+#define DISPATCH() continue
+#endif
+
+// Reads the 16-bit operand of a jump instruction. `ip` points right after the opcode.
+#define READ_JUMP_SIZE() ((uint16_t) ((ip[0] << 8) | ip[1]))
+
+// Reads the 24-bit operand of OP_CONSTANT_LONG. `ip` points right after the opcode.
+#define READ_LONG_INDEX() ((ip[0] << 16) | (ip[1] << 8) | ip[2])
+
+// Reads a 16-bit operand and moves `ip` past it.
+#define READ_SHORT() (ip += 2, (uint16_t) ((ip[-2] << 8) | ip[-1]))
+
+// Stack helpers working on the cached stack pointer `sp`, which always points at the first
+// free slot of `vm.stack`. The compiler emits balanced bytecode so popping never underflows, and
+// the stack space a function needs (`max_stack_depth`) is reserved once when calling it, so
+// pushing never overflows.
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
 
 // This is where our virtual machine will spend most of its time.
-// Our VM first reads the instruction from the array `code` (field in the VM struct), 
-// and then tries to decode it by executing this function.
-// Each operation/instruction has a specific handler that takes care of modifying the state of 
-// the stack and incrementing our VM's instruction pointer `current_frame->ip`.
-static void decodeInstruction(OpCode op) {
-		switch(op) {
-				case OP_ADD:
-						additionHandler();
-						break;
-				case OP_SUBSTRACT:
-						substractionHandler();
-						break;
-				case OP_MULTIPLY:
-						multiplicationHandler();
-						break;
-				case OP_DIVIDE:
-						divisionHandler();
-						break;
-				case OP_VALUE:
-						valueHandler();
-						break;
-				case OP_LESS:
-						lessHandler();
-						break;
-				case OP_LESS_EQUAL:
-						lessEqualHandler();
-						break;
-				case OP_EQUAL_EQUAL:
-						equalEqualHandler();
-						break;
-				case OP_GREATER:
-						greaterHandler();
-						break;
-				case OP_GREATER_EQUAL:
-						greaterEqualHandler();
-						break;
-				case OP_BANG_EQUAL:
-						bangEqualHandler();
-						break;
-				case OP_NOT:
-						notHandler();
-						break;
-				case OP_NEGATE:
-						negateHandler();
-						break;
-				case OP_GET:
-						getHandler(/*is_local = */true);
-						break;
-				case OP_ASSIGN:
-						assignHandler(/*is_local = */true);
-						break;
-				case OP_GET_GLOBAL:
-						getHandler(/*is_local = */false);
-						break;
-				case OP_ASSIGN_GLOBAL:
-						assignHandler(/*is_local = */false);
-						break;
-				case OP_POP:
-						pop();
-						current_frame->ip++;
-						break;
-				case OP_JUMP_IF_FALSE:
-						jumpIfFalseHandler();
-						break;
-				case OP_JUMP:
-						jumpHandler();
-						break;
-				case OP_JUMP_BACKWARD:
-						jumpBackwardHandler();
-						break;
-				case OP_CALL:
-						callHandler();
-						break;
-				case OP_PRINT:
-						printHandler();
-						break;
-				case OP_RETURN:
-						returnHandler();
-						break;
-		}
-}
-
+// The whole interpreter state used on the hot path lives in locals so that the compiler can keep
+// it in registers across instructions:
+//   + `ip` always points right after the opcode that is being executed.
+//   + `sp` is the cached `vm.stack_top`.
+//   + `slots` is the base of the local variables of the current frame.
+//   + `stack` is the cached `vm.stack`. It changes when the stack grows on a function call.
+//   + `globals` is the cached `vm.globals`, which does not change while the program runs.
+//   + `constants` is the constant pool of the current function.
+// Script calls do not recurse on the C stack: OP_CALL pushes a CallFrame and OP_RETURN pops it,
+// both switching the cached state to the new frame in place. Only the instruction pointer of the
+// caller needs to be saved in its frame.
+// Every function (including the top level script) ends with an OP_RETURN, so there is no need
+// to check for the end of the bytecode before each instruction. Returning from the frame set up
+// by `interpret()` leaves the loop.
 void decode() {
-		while(current_frame->ip < current_frame->function->code.count) {
-				uint8_t instruction = current_frame->function->code.array[current_frame->ip];
-				decodeInstruction(instruction);
+		uint8_t *code = current_frame->function->code.array;
+		uint8_t *ip = code + current_frame->ip;
+		Value *stack = vm.stack;
+		Value *sp = stack + vm.stack_top;
+		Value *slots = stack + current_frame->fn_stack_top + 1;
+		Value *constants = current_frame->function->constants.array;
+		Value *globals = vm.globals;
+
+#ifdef VM_COMPUTED_GOTO
+		static void *dispatch_table[] = {
+				[OP_ADD] = &&label_OP_ADD,
+				[OP_SUBSTRACT] = &&label_OP_SUBSTRACT,
+				[OP_NEGATE] = &&label_OP_NEGATE,
+				[OP_JUMP_IF_FALSE] = &&label_OP_JUMP_IF_FALSE,
+				[OP_JUMP_BACKWARD] = &&label_OP_JUMP_BACKWARD,
+				[OP_CALL] = &&label_OP_CALL,
+				[OP_JUMP] = &&label_OP_JUMP,
+				[OP_NOT] = &&label_OP_NOT,
+				[OP_MULTIPLY] = &&label_OP_MULTIPLY,
+				[OP_CHECK_REFLEXIVE_ASSIGNMENT] = &&label_OP_CHECK_REFLEXIVE_ASSIGNMENT,
+				[OP_DIVIDE] = &&label_OP_DIVIDE,
+				[OP_PRINT] = &&label_OP_PRINT,
+				[OP_SET_LOCAL] = &&label_OP_SET_LOCAL,
+				[OP_RETURN] = &&label_OP_RETURN,
+				[OP_VALUE] = &&label_OP_VALUE,
+				[OP_GET_GLOBAL] = &&label_OP_GET_GLOBAL,
+				[OP_SET_GLOBAL] = &&label_OP_SET_GLOBAL,
+				[OP_DEFINE_GLOBAL] = &&label_OP_DEFINE_GLOBAL,
+				[OP_LESS] = &&label_OP_LESS,
+				[OP_SET] = &&label_OP_SET,
+				[OP_GET_LOCAL] = &&label_OP_GET_LOCAL,
+				[OP_LESS_EQUAL] = &&label_OP_LESS_EQUAL,
+				[OP_POP] = &&label_OP_POP,
+				[OP_GREATER] = &&label_OP_GREATER,
+				[OP_GREATER_EQUAL] = &&label_OP_GREATER_EQUAL,
+				[OP_EQUAL_EQUAL] = &&label_OP_EQUAL_EQUAL,
+				[OP_BANG_EQUAL] = &&label_OP_BANG_EQUAL,
+				[OP_CONSTANT_LONG] = &&label_OP_CONSTANT_LONG,
+				[OP_SET_LOCAL_POP] = &&label_OP_SET_LOCAL_POP,
+				[OP_SET_GLOBAL_POP] = &&label_OP_SET_GLOBAL_POP,
+				[OP_INC_LOCAL] = &&label_OP_INC_LOCAL,
+				[OP_INC_GLOBAL] = &&label_OP_INC_GLOBAL,
+				[OP_LESS_CONST_JUMP_IF_FALSE] = &&label_OP_LESS_CONST_JUMP_IF_FALSE,
+				[OP_JUMP_BACKWARD_IF_TRUE] = &&label_OP_JUMP_BACKWARD_IF_TRUE,
+				[OP_JUMP_IF_FALSE_NO_POP] = &&label_OP_JUMP_IF_FALSE_NO_POP,
+				[OP_JUMP_IF_TRUE_NO_POP] = &&label_OP_JUMP_IF_TRUE_NO_POP,
+				[OP_LESS_CONST_JUMP_BACKWARD_IF_TRUE] = &&label_OP_LESS_CONST_JUMP_BACKWARD_IF_TRUE,
+				[OP_ADD_NUM] = &&label_OP_ADD_NUM,
+				[OP_ADD_STR] = &&label_OP_ADD_STR,
+				[OP_EQUAL_EQUAL_NUM] = &&label_OP_EQUAL_EQUAL_NUM,
+				[OP_BANG_EQUAL_NUM] = &&label_OP_BANG_EQUAL_NUM
+		};
+#endif
+
+		for(;;) {
+				COUNT_DISPATCH();
+				switch(*ip++) {
+						// '+' is quickened: the first time an OP_ADD runs, it rewrites itself in the bytecode
+						// into the instruction specialized for the types of its operands, and executes it.
+						// A specialized instruction that gets other types rewrites itself back into OP_ADD,
+						// which quickens again for the new types.
+						TARGET(OP_ADD): {
+								Value rhs = PEEK(0);
+								Value lhs = PEEK(1);
+
+								if(IS_NUMBER(lhs) && IS_NUMBER(rhs)) {
+										ip[-1] = OP_ADD_NUM;
+								}
+								else {
+										CHECK(IS_STRING(lhs) && IS_STRING(rhs), "Both Operands of '+' must be numbers or strings.");
+										ip[-1] = OP_ADD_STR;
+								}
+								ip--;
+								DISPATCH();
+						}
+						TARGET(OP_ADD_NUM): {
+								Value rhs = PEEK(0);
+								Value lhs = PEEK(1);
+
+								if(!IS_NUMBER(lhs) || !IS_NUMBER(rhs)) {
+										ip[-1] = OP_ADD;
+										ip--;
+										DISPATCH();
+								}
+								sp--;
+								sp[-1] = CREATE_NUMBER(AS_NUMBER(lhs) + AS_NUMBER(rhs));
+								DISPATCH();
+						}
+						TARGET(OP_ADD_STR): {
+								Value rhs = PEEK(0);
+								Value lhs = PEEK(1);
+
+								if(!IS_STRING(lhs) || !IS_STRING(rhs)) {
+										ip[-1] = OP_ADD;
+										ip--;
+										DISPATCH();
+								}
+								sp--;
+								sp[-1] = CREATE_STRING(concatenateStrings(AS_STRING(lhs), AS_STRING(rhs)));
+
+								// Concatenation is the only instruction that allocates, so it is where
+								// garbage gets collected.
+								if(shouldCollectGarbage()) {
+										vm.stack_top = sp - stack;
+										collectGarbage();
+								}
+								DISPATCH();
+						}
+						TARGET(OP_SUBSTRACT):
+								BINARY_OP(-, CREATE_NUMBER);
+								DISPATCH();
+						TARGET(OP_MULTIPLY):
+								BINARY_OP(*, CREATE_NUMBER);
+								DISPATCH();
+						TARGET(OP_DIVIDE):
+								BINARY_OP(/, CREATE_NUMBER);
+								DISPATCH();
+						TARGET(OP_LESS):
+								BINARY_OP(<, CREATE_BOOLEAN);
+								DISPATCH();
+						TARGET(OP_LESS_EQUAL):
+								BINARY_OP(<=, CREATE_BOOLEAN);
+								DISPATCH();
+						// Values of any type can be compared for equality. Strings are interned so comparing
+						// them is a pointer comparison.
+						// Equality of numbers is quickened like '+', into an instruction that does not call
+						// valueEquals(). Other types never fail, so they stay on the generic instruction.
+						TARGET(OP_EQUAL_EQUAL): {
+								if(IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+										ip[-1] = OP_EQUAL_EQUAL_NUM;
+										ip--;
+										DISPATCH();
+								}
+								Value rhs = POP();
+								sp[-1] = CREATE_BOOLEAN(valueEquals(&sp[-1], &rhs));
+								DISPATCH();
+						}
+						TARGET(OP_EQUAL_EQUAL_NUM): {
+								Value rhs = PEEK(0);
+								Value lhs = PEEK(1);
+
+								if(!IS_NUMBER(lhs) || !IS_NUMBER(rhs)) {
+										ip[-1] = OP_EQUAL_EQUAL;
+										ip--;
+										DISPATCH();
+								}
+								sp--;
+								sp[-1] = CREATE_BOOLEAN(AS_NUMBER(lhs) == AS_NUMBER(rhs));
+								DISPATCH();
+						}
+						TARGET(OP_GREATER):
+								BINARY_OP(>, CREATE_BOOLEAN);
+								DISPATCH();
+						TARGET(OP_GREATER_EQUAL):
+								BINARY_OP(>=, CREATE_BOOLEAN);
+								DISPATCH();
+						TARGET(OP_BANG_EQUAL): {
+								if(IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+										ip[-1] = OP_BANG_EQUAL_NUM;
+										ip--;
+										DISPATCH();
+								}
+								Value rhs = POP();
+								sp[-1] = CREATE_BOOLEAN(!valueEquals(&sp[-1], &rhs));
+								DISPATCH();
+						}
+						TARGET(OP_BANG_EQUAL_NUM): {
+								Value rhs = PEEK(0);
+								Value lhs = PEEK(1);
+
+								if(!IS_NUMBER(lhs) || !IS_NUMBER(rhs)) {
+										ip[-1] = OP_BANG_EQUAL;
+										ip--;
+										DISPATCH();
+								}
+								sp--;
+								sp[-1] = CREATE_BOOLEAN(AS_NUMBER(lhs) != AS_NUMBER(rhs));
+								DISPATCH();
+						}
+						TARGET(OP_VALUE):
+								PUSH(constants[*ip++]);
+								DISPATCH();
+						TARGET(OP_CONSTANT_LONG):
+								PUSH(constants[READ_LONG_INDEX()]);
+								ip += 3;
+								DISPATCH();
+						TARGET(OP_NOT): {
+								Value *top = &PEEK(0);
+
+								CHECK(IS_BOOLEAN(*top), "Operand of '!' operator must be a boolean!");
+								*top = CREATE_BOOLEAN(!AS_BOOLEAN(*top));
+								DISPATCH();
+						}
+						TARGET(OP_NEGATE): {
+								Value *top = &PEEK(0);
+
+								CHECK(IS_NUMBER(*top), "Operand of '-' operator must be a number!");
+								*top = CREATE_NUMBER(-AS_NUMBER(*top));
+								DISPATCH();
+						}
+						// Variable accesses take the slot of the variable as a 16-bit operand. Local slots are
+						// relative to the frame, global slots index `globals`.
+						TARGET(OP_GET_LOCAL):
+								PUSH(slots[READ_SHORT()]);
+								DISPATCH();
+						TARGET(OP_GET_GLOBAL):
+								PUSH(globals[READ_SHORT()]);
+								DISPATCH();
+						TARGET(OP_SET_LOCAL):
+								slots[READ_SHORT()] = PEEK(0);
+								DISPATCH();
+						TARGET(OP_SET_GLOBAL):
+								globals[READ_SHORT()] = PEEK(0);
+								DISPATCH();
+						TARGET(OP_DEFINE_GLOBAL):
+						TARGET(OP_SET_GLOBAL_POP):
+								globals[READ_SHORT()] = POP();
+								DISPATCH();
+						TARGET(OP_SET_LOCAL_POP):
+								slots[READ_SHORT()] = POP();
+								DISPATCH();
+						// `variable = variable + constant;` as a statement: the slot of the variable, then the
+						// position of the (number) constant.
+						TARGET(OP_INC_LOCAL): {
+								Value *variable = &slots[READ_SHORT()];
+								CHECK(IS_NUMBER(*variable), "Both Operands must be numbers");
+								*variable = CREATE_NUMBER(AS_NUMBER(*variable) + AS_NUMBER(constants[READ_SHORT()]));
+								DISPATCH();
+						}
+						TARGET(OP_INC_GLOBAL): {
+								Value *variable = &globals[READ_SHORT()];
+								CHECK(IS_NUMBER(*variable), "Both Operands must be numbers");
+								*variable = CREATE_NUMBER(AS_NUMBER(*variable) + AS_NUMBER(constants[READ_SHORT()]));
+								DISPATCH();
+						}
+						TARGET(OP_POP):
+								sp--;
+								DISPATCH();
+						// Jump sizes are relative to the position of the jump opcode, i.e `ip - 1`.
+						TARGET(OP_JUMP_IF_FALSE): {
+								uint16_t jump_size = READ_JUMP_SIZE();
+								ip += !isTrue(POP()) ? jump_size - 1 : 2;
+								DISPATCH();
+						}
+						// `value < constant` followed by OP_JUMP_IF_FALSE: the position of the (number) constant,
+						// then the jump size.
+						TARGET(OP_LESS_CONST_JUMP_IF_FALSE): {
+								Value lhs = POP();
+								CHECK(IS_NUMBER(lhs), "Both Operands must be numbers");
+								double rhs = AS_NUMBER(constants[READ_SHORT()]);
+								ip += AS_NUMBER(lhs) < rhs ? 2 : READ_JUMP_SIZE() - 3;
+								DISPATCH();
+						}
+						// The condition of a loop, which is tested after its body: jumps back to the body while
+						// it is true.
+						TARGET(OP_JUMP_BACKWARD_IF_TRUE): {
+								uint16_t jump_size = READ_JUMP_SIZE();
+								ip += isTrue(POP()) ? -jump_size - 1 : 2;
+								DISPATCH();
+						}
+						TARGET(OP_LESS_CONST_JUMP_BACKWARD_IF_TRUE): {
+								Value lhs = POP();
+								CHECK(IS_NUMBER(lhs), "Both Operands must be numbers");
+								double rhs = AS_NUMBER(constants[READ_SHORT()]);
+								ip += AS_NUMBER(lhs) < rhs ? -READ_JUMP_SIZE() - 3 : 2;
+								DISPATCH();
+						}
+						// `and` and `or` keep their left operand, which is their value when they jump.
+						TARGET(OP_JUMP_IF_FALSE_NO_POP): {
+								uint16_t jump_size = READ_JUMP_SIZE();
+								ip += !isTrue(PEEK(0)) ? jump_size - 1 : 2;
+								DISPATCH();
+						}
+						TARGET(OP_JUMP_IF_TRUE_NO_POP): {
+								uint16_t jump_size = READ_JUMP_SIZE();
+								ip += isTrue(PEEK(0)) ? jump_size - 1 : 2;
+								DISPATCH();
+						}
+						TARGET(OP_JUMP):
+								ip += READ_JUMP_SIZE() - 1;
+								DISPATCH();
+						TARGET(OP_JUMP_BACKWARD):
+								ip -= READ_JUMP_SIZE() + 1;
+								DISPATCH();
+						TARGET(OP_PRINT): {
+								Value to_print = POP();
+
+								printValue(&to_print);
+								printf("\n");
+								DISPATCH();
+						}
+						// OP_CALL arity
+						TARGET(OP_CALL): {
+								int arity = *ip++;
+								Value function = PEEK(arity);
+
+								CHECK(IS_FUNCTION(function), "not a function");
+								CHECK(AS_FUNCTION(function)->arity == arity, "Wrong number of arguments");
+
+								int fn_stack_top = (sp - stack) - arity - 1;
+								int required = fn_stack_top + 1 + AS_FUNCTION(function)->max_stack_depth;
+								if(required > vm.stack_capacity) {
+										growStack(required);
+										stack = vm.stack;
+										sp = stack + fn_stack_top + 1 + arity;
+								}
+								if(vm.frame_top == vm.frame_capacity) {
+										growFrames();
+										current_frame = &vm.frames[vm.frame_top - 1];
+								}
+
+								current_frame->ip = ip - code;
+								current_frame = &vm.frames[vm.frame_top++];
+								current_frame->function = AS_FUNCTION(function);
+								current_frame->fn_stack_top = fn_stack_top;
+
+								code = current_frame->function->code.array;
+								constants = current_frame->function->constants.array;
+								ip = code;
+								slots = stack + fn_stack_top + 1;
+								DISPATCH();
+						}
+						TARGET(OP_RETURN): {
+								if(vm.frame_top == 1) {
+										vm.stack_top = sp - stack;
+										return;
+								}
+
+								// Replace the callee and its arguments with the return value.
+								Value return_value = PEEK(0);
+								sp = stack + current_frame->fn_stack_top;
+								*sp++ = return_value;
+
+								vm.frame_top--;
+								current_frame = &vm.frames[vm.frame_top - 1];
+								code = current_frame->function->code.array;
+								constants = current_frame->function->constants.array;
+								ip = code + current_frame->ip;
+								slots = stack + current_frame->fn_stack_top + 1;
+								DISPATCH();
+						}
+						TARGET(OP_CHECK_REFLEXIVE_ASSIGNMENT):
+						TARGET(OP_SET):
+								CHECK(false, "Unsupported instruction");
+				}
 		}
 }
 
+#undef TARGET
+#undef DISPATCH
+#undef COUNT_DISPATCH
+#undef READ_JUMP_SIZE
+#undef READ_LONG_INDEX
+#undef READ_SHORT
+#undef PUSH
+#undef POP
+#undef PEEK
+
 void interpret() {
+		// The script sits below its locals like any called function.
+		if(vm.stack_top + 1 + current_function->max_stack_depth > vm.stack_capacity) {
+				growStack(vm.stack_top + 1 + current_function->max_stack_depth);
+		}
 		current_frame = &vm.frames[vm.frame_top++];
 		current_frame->function = current_function;
 		current_frame->ip = 0;
-		current_frame->fn_stack_top = 0;
+		current_frame->fn_stack_top = vm.stack_top;
+		push(CREATE_FUNCTION(current_function));
 
 		decode();
 
+#ifdef VM_COUNT_DISPATCHES
+		fprintf(stderr, "dispatches: %llu\n", dispatch_count);
+#endif
 }
@@ -7,9 +7,11 @@
 #include <stdint.h>
 
 /*
- * This macro performs a binary operation using the operator `op` and
- * pushes the result into the stack. The type of the result is based on the parameter 
+ * This macro performs a binary operation using the operator `op` on the two values at the top
+ * of the stack and replaces them with the result. The type of the result is based on the parameter 
  * `value_type`.
+ * It works on the stack pointer `sp` that the dispatch loop keeps in a local variable, so it can
+ * only be used inside `decode()`.
  * The macro is wrapped around a do while loop (that executes once) in order to avoid any 
  * scoping problems and other obscure bugs.
  * We check whether the two operands of the operator `op` are numbers, otherwise we report an error
@@ -17,10 +19,11 @@
  * */
 #define BINARY_OP(op, value_type) \
 		do { \
-				Value rhs = pop(); \
-				Value lhs = pop(); \
+				Value rhs = sp[-1]; \
+				Value lhs = sp[-2]; \
 				CHECK(IS_NUMBER(lhs) && IS_NUMBER(rhs), "Both Operands must be numbers"); \
-				push(value_type(lhs.as.number op rhs.as.number)); \
+				sp--; \
+				sp[-1] = value_type(AS_NUMBER(lhs) op AS_NUMBER(rhs)); \
 		} while(false)
 
 typedef struct VM VM;
@@ -39,31 +42,57 @@ typedef enum {
 		OP_CHECK_REFLEXIVE_ASSIGNMENT,
 		OP_DIVIDE,
 		OP_PRINT,
-		OP_ASSIGN,
+		OP_SET_LOCAL,
 		OP_RETURN,
 		OP_VALUE,
 		OP_GET_GLOBAL,
-		OP_ASSIGN_GLOBAL,
+		OP_SET_GLOBAL,
 		OP_LESS,
 		OP_SET,
-		OP_GET,
+		OP_GET_LOCAL,
 		OP_LESS_EQUAL,
 		OP_POP,
 		OP_GREATER,
 		OP_GREATER_EQUAL,
 		OP_EQUAL_EQUAL,
-		OP_BANG_EQUAL
+		OP_BANG_EQUAL,
+		OP_CONSTANT_LONG,
+		OP_DEFINE_GLOBAL,
+		OP_JUMP_BACKWARD_IF_TRUE,
+		OP_JUMP_IF_FALSE_NO_POP,
+		OP_JUMP_IF_TRUE_NO_POP,
+		// Superinstructions, which the optimizer fuses from common sequences of instructions (see ir.c).
+		OP_SET_LOCAL_POP,
+		OP_SET_GLOBAL_POP,
+		OP_INC_LOCAL,
+		OP_INC_GLOBAL,
+		OP_LESS_CONST_JUMP_IF_FALSE,
+		OP_LESS_CONST_JUMP_BACKWARD_IF_TRUE,
+		// Specialized instructions, which the VM writes over the generic ones as it runs (see OP_ADD).
+		OP_ADD_NUM,
+		OP_ADD_STR,
+		OP_EQUAL_EQUAL_NUM,
+		OP_BANG_EQUAL_NUM
 } OpCode;
 
 // There will be one global instance of the virtual machine throughout the whole process.
 struct VM {
-		CallFrame frames[STACK_MAX];
+		CallFrame *frames;
 		int frame_top;
+		int frame_capacity;
 
-		Value stack[STACK_MAX];
+		Value *stack;
 		int stack_top;
+		int stack_capacity;
 
-		ValueArray value_array;
+		// Global variables, indexed by the slot the compiler gave to their name in `table`.
+		// Slots are allocated at compile time, and the value of a global is nil until its
+		// declaration is executed.
+		Value *globals;
+		int global_count;
+		int global_capacity;
+
+		// Name of each global variable -> its slot (a number) in `globals`.
 		HashTable table;
 		int scope;
 };
@@ -75,9 +104,12 @@ void push(Value value);
 // Pops the last value pushed into the stack of our virtual machine and
 // returns it.
 Value pop();
+// Reserves a new slot in `vm.globals` and returns it.
+int addGlobal();
 
 // Interpret the bytecode written in the ByteArray.
 void interpret();
+// Runs the dispatch loop from `current_frame` until the outermost frame returns.
 void decode();
 
 extern VM vm;
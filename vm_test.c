@@ -0,0 +1,229 @@
+#include "tokenizer.h"
+#include "parser.h"
+#include "vm.h"
+#include "error.h"
+#include "gc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Compiles and runs scripts, and compares what they print with the expected output at every
+// optimization level. Each script runs in its own process, since the VM is global.
+
+#define OUTPUT_CAPACITY 4096
+
+// Runs `source` at optimization `level` in a child process and returns whether it exited normally
+// after printing `expected`, and `verify` (if not NULL) returned true in the child once the script was done.
+bool runAndCheck(const char *source, int level, const char *expected, bool (*verify)()) {
+		int fds[2];
+		CHECK(pipe(fds) == 0, "Failed to create a pipe");
+		pid_t pid = fork();
+		CHECK(pid >= 0, "Failed to fork");
+		if(pid == 0) {
+				close(fds[0]);
+				dup2(fds[1], STDOUT_FILENO);
+
+				setOptimizationLevel(level);
+				initVM(&vm);
+				initTokenizer(&tokenizer);
+				tokenizer.source_length = strlen(source);
+				tokenizer.source_file = malloc(tokenizer.source_length + 1);
+				strcpy(tokenizer.source_file, source);
+				initParser(&parser);
+				parse();
+				interpret();
+				fflush(stdout);
+				_exit(verify == NULL || verify() ? 0 : 1);
+		}
+		close(fds[1]);
+
+		char output[OUTPUT_CAPACITY];
+		int length = 0;
+		ssize_t read_size;
+		while((read_size = read(fds[0], output + length, OUTPUT_CAPACITY - 1 - length)) > 0) length += read_size;
+		output[length] = '\0';
+		close(fds[0]);
+
+		int status;
+		waitpid(pid, &status, 0);
+		bool result = WIFEXITED(status) && WEXITSTATUS(status) == 0 && strcmp(output, expected) == 0;
+		if(!result) printf("-O%d: %s\nprinted:\n%s", level, source, output);
+		return result;
+}
+
+bool runAndCompare(const char *source, int level, const char *expected) {
+		return runAndCheck(source, level, expected, NULL);
+}
+
+bool checkAtAllLevels(const char *source, const char *expected, bool (*verify)()) {
+		bool result = true;
+		for(int level = 0; level <= 2; ++level) {
+				result = runAndCheck(source, level, expected, verify) && result;
+		}
+		return result;
+}
+
+bool runAtAllLevels(const char *source, const char *expected) {
+		return checkAtAllLevels(source, expected, NULL);
+}
+
+// `and` and `or` evaluate to the operand that decides them, and leave exactly one value on the
+// stack whichever way they go.
+bool test00() {
+		bool result = true;
+		result = runAtAllLevels("print false and true;", "false\n") && result;
+		result = runAtAllLevels("print true and false;", "false\n") && result;
+		result = runAtAllLevels("print true and 2;", "2\n") && result;
+		result = runAtAllLevels("print nil and 2;", "nil\n") && result;
+		result = runAtAllLevels("print true or false;", "true\n") && result;
+		result = runAtAllLevels("print false or 3;", "3\n") && result;
+		result = runAtAllLevels("print nil or false;", "false\n") && result;
+		result = runAtAllLevels("print 1 or 2 and 3;", "1\n") && result;
+		result = runAtAllLevels("print false or true and 4;", "4\n") && result;
+
+		// Operands that are not constants, and locals declared after the expression.
+		result = runAtAllLevels(
+				"var a = false; var b = 5;"
+				"{ var x = a and b; var y = a or b; var z = 7; print x; print y; print z; }",
+				"false\n5\n7\n") && result;
+		result = runAtAllLevels(
+				"fun pick(a, b) { var v = a or b; return v; }"
+				"print pick(nil, 1); print pick(2, 1);",
+				"1\n2\n") && result;
+		// Conditions of branches and loops, many times over.
+		result = runAtAllLevels(
+				"var n = 0;"
+				"for (var i = 0; i < 1000; i = i + 1) {"
+				"  if ((i < 10 and i != 3) or i == 500) n = n + 1;"
+				"  var t = false and true; var u = true or false;"
+				"}"
+				"print n;",
+				"10\n") && result;
+		result = runAtAllLevels(
+				"var i = 0; while (i < 5 and i != 3) i = i + 1; print i;",
+				"3\n") && result;
+		return result;
+}
+
+// Every collection is one pause, and both kinds of collections ran and freed memory.
+bool checkCollections() {
+		GCPauseStats pauses = getGCPauseStats();
+		uint64_t bucket_sum = 0;
+		for(int i = 0; i < GC_PAUSE_BUCKETS; ++i) bucket_sum += pauses.histogram[i];
+
+		bool result = gc.minor_collections > 0 && gc.major_collections > 0 && gc.total_bytes_freed > 0 &&
+						bucket_sum == pauses.pause_count && pauses.pause_count == (uint64_t) gc.minor_collections &&
+						pauses.max_pause_ns > 0 && pauses.total_pause_ns >= pauses.max_pause_ns;
+		if(!result) {
+				fprintf(stderr, "minor: %d, major: %d, freed: %zu, pauses: %llu\n", gc.minor_collections,
+								gc.major_collections, gc.total_bytes_freed, (unsigned long long) pauses.pause_count);
+		}
+		return result;
+}
+
+// Strings built in a loop and by a function keep their contents through minor and major collections:
+// `b` lives long enough to be promoted and swept over by major collections, the prefixes of `a` are
+// interned again after they died, and `key` dies young. The tests are also built with a tiny heap and with GC_STRESS (see CMakeLists.txt).
+bool test01() {
+		return checkAtAllLevels(
+				"fun tag(s) { return \"<\" + s + \">\"; }"
+				"var a = \"\"; var b = \"\"; var resets = 0;"
+				"for (var i = 0; i < 20000; i = i + 1) {"
+				"  a = a + \"x\";"
+				"  if (a == \"xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\") {"
+				"    a = \"\"; b = b + \"yyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyy\"; resets = resets + 1;"
+				"  }"
+				"  var key = tag(b + \":\" + a);"
+				"}"
+				"var c = \"\";"
+				"for (var j = 0; j < resets; j = j + 1) c = c + \"yyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyy\";"
+				"print resets; print a; print b == c;",
+				"312\nxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\ntrue\n", checkCollections);
+}
+
+// Strings interned again while a major collection sweeps must survive it (see shadeObject). The prefixes
+// of `w` are promoted, die at the end of a round, and are found again in the intern table by the next
+// round, while the small heap build is sweeping. If one was freed while `w` held it, `w` would no
+// longer be the interned string the comparisons find.
+bool test02() {
+		return runAtAllLevels(
+				"var tail = \"\"; var broken = 0;"
+				"for (var round = 0; round < 500; round = round + 1) {"
+				"  var w = \"\";"
+				"  for (var k = 0; k < 20; k = k + 1) {"
+				"    var prefix = w;"
+				"    w = w + \"a\";"
+				"    if (w == prefix) broken = broken + 1;"
+				"    var junk = w + \"|\" + tail;"
+				"  }"
+				"  if (w != \"aaaaaaaaaaaaaaaaaaaa\") broken = broken + 1;"
+				"  tail = tail + \"t\";"
+				"}"
+				"print broken;",
+				"0\n");
+}
+
+// Bound on the heap of a script whose live data is small: a full nursery, and an old generation that
+// starts a major collection when it reaches GC_INITIAL_THRESHOLD and grows at most as much again while it runs.
+#define FLAT_HEAP_BOUND (GC_NURSERY_SIZE + GC_HEAP_GROW_FACTOR * GC_INITIAL_THRESHOLD)
+
+// Bytes that the script checked by checkFlatHeap() must have allocated. Set by the parent before the fork.
+static size_t min_allocated_bytes;
+
+bool checkFlatHeap() {
+		bool result = gc.max_heap_bytes <= FLAT_HEAP_BOUND && gc.young_bytes + gc.old_bytes <= FLAT_HEAP_BOUND &&
+						gc.total_bytes_allocated >= min_allocated_bytes;
+		if(!result) {
+				fprintf(stderr, "peak: %zu, live: %zu, allocated: %zu bytes\n", gc.max_heap_bytes,
+								gc.young_bytes + gc.old_bytes, gc.total_bytes_allocated);
+		}
+		return result;
+}
+
+#define FLAT_HEAP_SOURCE(iterations) \
+		"var a = \"\"; var b = \"\"; var c = \"\"; var b_resets = 0; var c_resets = 0;" \
+		"for (var i = 0; i < " #iterations "; i = i + 1) {" \
+		"  a = a + \"x\";" \
+		"  if (a == \"xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx\") {" \
+		"    a = \"\"; b = b + \"y\"; b_resets = b_resets + 1;" \
+		"    if (b == \"yyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyy\") {" \
+		"      b = \"\"; c = c + \"z\"; c_resets = c_resets + 1;" \
+		"    }" \
+		"  }" \
+		"  var key = c + \":\" + b + \":\" + a;" \
+		"}" \
+		"print b_resets; print c_resets;"
+
+// A loop that keeps building new strings but only keeps a few of them has a flat memory profile: four
+// times more iterations allocate four times more, and the heap stays under the same bound.
+bool test03() {
+		bool result = true;
+		min_allocated_bytes = 2 * FLAT_HEAP_BOUND;
+		result = checkAtAllLevels(FLAT_HEAP_SOURCE(20000), "312\n4\n", checkFlatHeap) && result;
+		min_allocated_bytes = 8 * FLAT_HEAP_BOUND;
+		result = checkAtAllLevels(FLAT_HEAP_SOURCE(80000), "1250\n19\n", checkFlatHeap) && result;
+		return result;
+}
+
+// A unary operator applies to its operand only: `-a - b` is one subtraction. Parsing it as two unary
+// expressions left a value on the stack, which shifted the slots of the locals declared after it.
+bool test04() {
+		bool result = true;
+		result = runAtAllLevels("print -1 - -2; { var q = 7; var r = q; print r + q; }", "1\n14\n") && result;
+		result = runAtAllLevels(
+				"var a = 3; var b = 5; print -a - b; print - -4; print !true == false;"
+				"{ var x = -a * -b; var y = x; print y - -a; }",
+				"-8\n4\ntrue\n18\n") && result;
+		return result;
+}
+
+int main(int argc, char **argv) {
+		CHECK(test00(), "Failed test00");
+		CHECK(test01(), "Failed test01");
+		CHECK(test02(), "Failed test02");
+		CHECK(test03(), "Failed test03");
+		CHECK(test04(), "Failed test04");
+		printf("Tests Suceeded!\n");
+}